@@ -0,0 +1,534 @@
+/* Throughput benchmark. Generates a deterministic PGS stream and times
+ * every stage of the pipeline on it separately. */
+
+#include "common.hpp"
+#include "bitmap.hpp"
+#include "byteorder.hpp"
+#include "colorspace.hpp"
+#include "format_sup.hpp"
+#include "png.hpp"
+#include "scale.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <unistd.h>
+
+/* Shape of the generated stream */
+class CorpusOptions
+{
+public:
+    CorpusOptions()
+        : width(1920), height(1080), subtitles(200), density(0.6),
+          objects(2), fragment(0xffff - 11), seed(1)
+    {
+    }
+
+    u16 width, height;
+    unsigned int subtitles;
+    /* share of character cells that hold a glyph */
+    double density;
+    /* text lines shown at once, each its own object, 1 or 2 */
+    unsigned int objects;
+    /* most RLE bytes per ODS, smaller values split objects */
+    unsigned int fragment;
+    unsigned int seed;
+};
+
+/* What generate() produced */
+class Corpus
+{
+public:
+    std::vector<u8> data;
+    unsigned int images;
+    unsigned int fragmented;
+};
+
+enum
+{
+    PCS = 0x16,
+    WDS = 0x17,
+    PDS = 0x14,
+    ODS = 0x15,
+    END = 0x80,
+};
+
+static void put_segment(std::vector<u8>& out, u8 type, u32 pts,
+                        const std::vector<u8>& payload)
+{
+    u8 header[13] = { 'P', 'G' };
+    store_be32(header + 2, pts);
+    store_be32(header + 6, 0);
+    header[10] = type;
+    store_be16(header + 11, payload.size());
+    out.insert(out.end(), header, header + sizeof(header));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+static void put16(std::vector<u8>& out, u16 x)
+{
+    out.push_back(x >> 8);
+    out.push_back(x);
+}
+
+/* PGS run length coding of one object, see decode_object() */
+static void encode_rle(const std::vector<u8>& index, u32 width, u32 height,
+                       std::vector<u8>& out)
+{
+    for (u32 y = 0; y < height; y++)
+    {
+        const u8* row = &index[y * width];
+        u32 x = 0;
+        while (x < width)
+        {
+            const u8 color = row[x];
+            u32 n = 1;
+            while (x + n < width && row[x + n] == color && n < 0x3fff)
+            {
+                n++;
+            }
+            if (color != 0 && n < 3)
+            {
+                out.insert(out.end(), n, color);
+            }
+            else
+            {
+                out.push_back(0);
+                u8 flags = (color != 0 ? 0x80 : 0) | (n >= 64 ? 0x40 : 0);
+                if (n >= 64)
+                {
+                    out.push_back(flags | (n >> 8));
+                    out.push_back(n);
+                }
+                else
+                {
+                    out.push_back(flags | n);
+                }
+                if (color != 0)
+                {
+                    out.push_back(color);
+                }
+            }
+            x += n;
+        }
+        out.push_back(0);
+        out.push_back(0);
+    }
+}
+
+/* A line of text: glyphs of strokes in colour 1 with a two pixel outline
+ * in colour 2 and anti-aliased edges in 3 on a transparent background */
+static void draw_line(std::vector<u8>& index, u32 width, u32 height,
+                      double density, std::mt19937& rng)
+{
+    index.assign(width * height, 0);
+    const u32 cell = std::max<u32>(4, height * 11 / 20);
+    const u32 stroke = std::max<u32>(1, height / 10);
+    for (u32 x0 = stroke + 2; x0 + cell + stroke + 2 < width; x0 += cell)
+    {
+        if (rng() % 1000 >= density * 1000)
+        {
+            continue;
+        }
+        for (unsigned int n = 2 + rng() % 3; n > 0; n--)
+        {
+            /* vertical or horizontal stroke inside the cell */
+            u32 x = x0 + rng() % (cell - stroke), y = 2 + rng() % (height / 3);
+            u32 w = stroke, h = height - 4 - y - rng() % (height / 4);
+            if (rng() % 2)
+            {
+                w = cell - (x - x0);
+                h = stroke;
+            }
+            for (u32 yy = y - 2; yy < y + h + 2; yy++)
+            {
+                for (u32 xx = x - 2; xx < x + w + 2 && xx < width; xx++)
+                {
+                    u8& p = index[yy * width + xx];
+                    const bool inside = yy >= y && yy < y + h && xx >= x && xx < x + w;
+                    const bool edge = inside && (yy == y || xx == x);
+                    if (inside)
+                    {
+                        p = edge ? 3 : 1;
+                    }
+                    else if (p == 0)
+                    {
+                        p = 2;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static Corpus generate(const CorpusOptions& options)
+{
+    Corpus corpus;
+    corpus.images = 0;
+    corpus.fragmented = 0;
+    std::mt19937 rng(options.seed);
+    std::vector<u8> payload, index, rle;
+    const u32 line = std::max<u32>(8, options.height / 18);
+    u32 pts = 90000;
+    u16 comp_num = 0;
+    for (unsigned int i = 0; i < options.subtitles; i++)
+    {
+        /* lines from the bottom up, each in a window of its own */
+        u16 x[2], y[2], w[2];
+        for (unsigned int o = 0; o < options.objects; o++)
+        {
+            w[o] = options.width * (30 + rng() % 50) / 100;
+            x[o] = (options.width - w[o]) / 2;
+            y[o] = options.height - (line + line / 4) * (options.objects - o) -
+                   options.height / 20;
+        }
+
+        payload.clear();
+        put16(payload, options.width);
+        put16(payload, options.height);
+        payload.push_back(0x10);
+        put16(payload, comp_num++);
+        payload.push_back(0x80);
+        payload.push_back(0);
+        payload.push_back(0);
+        payload.push_back(options.objects);
+        for (unsigned int o = 0; o < options.objects; o++)
+        {
+            put16(payload, o);
+            payload.push_back(o);
+            payload.push_back(0);
+            put16(payload, x[o]);
+            put16(payload, y[o]);
+        }
+        put_segment(corpus.data, PCS, pts, payload);
+
+        payload.clear();
+        payload.push_back(options.objects);
+        for (unsigned int o = 0; o < options.objects; o++)
+        {
+            payload.push_back(o);
+            put16(payload, x[o]);
+            put16(payload, y[o]);
+            put16(payload, w[o]);
+            put16(payload, line);
+        }
+        put_segment(corpus.data, WDS, pts, payload);
+
+        /* transparent, white, black, grey edge */
+        static const u8 palette[][5] = {
+            { 0, 16, 128, 128, 0 },
+            { 1, 235, 128, 128, 255 },
+            { 2, 16, 128, 128, 255 },
+            { 3, 126, 128, 128, 160 },
+        };
+        payload.assign(2, 0);
+        for (size_t e = 0; e < sizeof(palette) / sizeof(palette[0]); e++)
+        {
+            payload.insert(payload.end(), palette[e], palette[e] + 5);
+        }
+        put_segment(corpus.data, PDS, pts, payload);
+
+        for (unsigned int o = 0; o < options.objects; o++)
+        {
+            draw_line(index, w[o], line, options.density, rng);
+            rle.clear();
+            encode_rle(index, w[o], line, rle);
+            size_t pos = 0;
+            do
+            {
+                const bool first = pos == 0;
+                const size_t size = std::min<size_t>(options.fragment, rle.size() - pos);
+                const bool last = pos + size == rle.size();
+                payload.clear();
+                put16(payload, o);
+                payload.push_back(0);
+                payload.push_back((first ? 0x80 : 0) | (last ? 0x40 : 0));
+                if (first)
+                {
+                    const u32 total = rle.size() + 4;
+                    payload.push_back(total >> 16);
+                    put16(payload, total);
+                    put16(payload, w[o]);
+                    put16(payload, line);
+                }
+                payload.insert(payload.end(), rle.begin() + pos, rle.begin() + pos + size);
+                put_segment(corpus.data, ODS, pts, payload);
+                pos += size;
+            } while (pos < rle.size());
+            if (rle.size() > options.fragment)
+            {
+                corpus.fragmented++;
+            }
+            corpus.images++;
+        }
+        put_segment(corpus.data, END, pts, std::vector<u8>());
+
+        /* clear after two to five seconds */
+        pts += 180000 + rng() % 270000;
+        payload.clear();
+        put16(payload, options.width);
+        put16(payload, options.height);
+        payload.push_back(0x10);
+        put16(payload, comp_num++);
+        payload.push_back(0);
+        payload.push_back(0);
+        payload.push_back(0);
+        payload.push_back(0);
+        put_segment(corpus.data, PCS, pts, payload);
+        put_segment(corpus.data, END, pts, std::vector<u8>());
+        pts += 9000 + rng() % 90000;
+    }
+    return corpus;
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void report(const char* name, double bytes, double images, double per_pass)
+{
+    std::printf("%-18s %10.1f %12.1f\n", name, bytes / per_pass / 1e6,
+                images / per_pass);
+}
+
+/* Runs stage until at least min_time has passed and prints the rate per
+ * pass, bytes and images are what one pass processes. Returns the time of
+ * one pass. */
+template<typename Stage>
+static double measure(const char* name, double bytes, double images,
+                      double min_time, Stage stage)
+{
+    unsigned int passes = 0;
+    const bench_clock::time_point start = bench_clock::now();
+    double elapsed;
+    do
+    {
+        stage();
+        passes++;
+        elapsed = seconds_since(start);
+    } while (elapsed < min_time);
+    const double per_pass = elapsed / passes;
+    report(name, bytes, images, per_pass);
+    return per_pass;
+}
+
+static double rgba_bytes(const Subtitle::subimages_t& images)
+{
+    double bytes = 0;
+    for (Subtitle::subimages_t::const_iterator i(images.begin()); i != images.end(); ++i)
+    {
+        bytes += (double)i->width * i->height * sizeof(u32);
+    }
+    return bytes;
+}
+
+static bool decode_all(const char* path, bool indexed, Subtitle& subtitle)
+{
+    SupReader reader;
+    reader.set_indexed(indexed);
+    if (!reader.open(path))
+    {
+        return false;
+    }
+    subtitle.images.clear();
+    return reader.read_all(subtitle);
+}
+
+static void usage(const char* argv0)
+{
+    std::cerr << "usage: " << argv0 << " [OPTIONS]" << std::endl
+              << std::endl
+              << "  -s, --size=WxH        frame size (default 1920x1080)" << std::endl
+              << "  -n, --subtitles=N     subtitles in the stream (default 200)" << std::endl
+              << "  -d, --density=D       share of glyph cells in use, 0 - 1 (default 0.6)" << std::endl
+              << "  -o, --objects=N       text lines per composition, 1 or 2 (default 2)" << std::endl
+              << "  -F, --fragment=BYTES  most RLE bytes per ODS (default 65524)" << std::endl
+              << "  -x, --factor=F        scaling factor (default 0.6667)" << std::endl
+              << "  -t, --time=SECONDS    least time per stage (default 0.5)" << std::endl
+              << "  -r, --seed=N          generator seed (default 1)" << std::endl
+              << std::endl
+              << "MB/s counts the .sup bytes for the header scan and decode, RGBA" << std::endl
+              << "bytes for the rest. ycbcr is decode + ycbcr less decode." << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option long_options[] = {
+        { "size", required_argument, NULL, 's' },
+        { "subtitles", required_argument, NULL, 'n' },
+        { "density", required_argument, NULL, 'd' },
+        { "objects", required_argument, NULL, 'o' },
+        { "fragment", required_argument, NULL, 'F' },
+        { "factor", required_argument, NULL, 'x' },
+        { "time", required_argument, NULL, 't' },
+        { "seed", required_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 }
+    };
+    CorpusOptions options;
+    float factor = 0.6667f;
+    double min_time = 0.5;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:n:d:o:F:x:t:r:", long_options, NULL)) != -1)
+    {
+        unsigned int w, h;
+        switch (opt)
+        {
+        case 's':
+            if (std::sscanf(optarg, "%ux%u", &w, &h) != 2 || w < 64 || h < 64 ||
+                w > 0xffff || h > 0xffff)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            options.width = w;
+            options.height = h;
+            break;
+        case 'n':
+            options.subtitles = std::strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            options.density = std::atof(optarg);
+            break;
+        case 'o':
+            options.objects = std::strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            options.fragment = std::strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            factor = std::atof(optarg);
+            break;
+        case 't':
+            min_time = std::atof(optarg);
+            break;
+        case 'r':
+            options.seed = std::strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || options.subtitles == 0 || options.objects < 1 ||
+        options.objects > 2 || options.fragment < 1 ||
+        options.fragment > 0xffff - 11 || !(factor > 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/subscale-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL)
+    {
+        std::cerr << "unable to create a temporary directory" << std::endl;
+        return 1;
+    }
+    const std::string sup = std::string(dir) + "/bench.sup";
+    const std::string bmp = std::string(dir) + "/bench.bmp";
+    const std::string png = std::string(dir) + "/bench.png";
+
+    const Corpus corpus = generate(options);
+    {
+        std::ofstream out(sup.c_str(), std::ios_base::out | std::ios_base::binary);
+        out.write(reinterpret_cast<const char*>(&corpus.data[0]), corpus.data.size());
+    }
+    const double size = corpus.data.size();
+    std::printf("corpus: %ux%u, %u subtitles, %u images (%u fragmented), %.1f MB\n\n",
+                options.width, options.height, options.subtitles, corpus.images,
+                corpus.fragmented, size / 1e6);
+
+    Subtitle indexed, rgba;
+    if (!decode_all(sup.c_str(), true, indexed) || !decode_all(sup.c_str(), false, rgba) ||
+        indexed.images.size() != corpus.images)
+    {
+        std::cerr << "generated stream does not decode" << std::endl;
+        unlink(sup.c_str());
+        rmdir(dir);
+        return 1;
+    }
+    const double images = corpus.images;
+    const double pixels = rgba_bytes(rgba.images);
+
+    std::printf("%-18s %10s %12s\n", "stage", "MB/s", "images/s");
+    /* segment headers only, what the epoch index needs */
+    measure("header scan", size, images, min_time, [&]() {
+        SupIndex index;
+        index.build(&corpus.data[0], corpus.data.size());
+    });
+    /* the reader as s and w use it, parsing and RLE decoding in palette
+     * indices, then the same with conversion to RGBA */
+    Subtitle decoded;
+    const double indexed_time = measure("decode", size, images, min_time, [&]() {
+        decode_all(sup.c_str(), true, decoded);
+    });
+    const double rgba_time = measure("decode + ycbcr", size, images, min_time, [&]() {
+        decode_all(sup.c_str(), false, decoded);
+    });
+    /* what the RGBA path costs over the indexed one: palette conversion
+     * and the lookup of every pixel */
+    report("ycbcr", pixels, images, std::max(rgba_time - indexed_time, 1e-9));
+    decoded.images.clear();
+
+    static const struct
+    {
+        const char* name;
+        scale_filter_t filter;
+    } filters[] = {
+        { "scale nn", SCALE_FILTER_NN },
+        { "scale bilinear", SCALE_FILTER_BILINEAR },
+        { "scale area", SCALE_FILTER_AREA },
+        { "scale bicubic", SCALE_FILTER_BICUBIC },
+        { "scale lanczos", SCALE_FILTER_LANCZOS },
+    };
+    for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++)
+    {
+        measure(filters[f].name, pixels, images, min_time, [&]() {
+            for (Subtitle::subimages_t::const_iterator i(rgba.images.begin());
+                 i != rgba.images.end(); ++i)
+            {
+                scale_filter(*i, factor, filters[f].filter);
+            }
+        });
+    }
+
+    measure("write bmp", pixels, images, min_time, [&]() {
+        for (Subtitle::subimages_t::const_iterator i(rgba.images.begin());
+             i != rgba.images.end(); ++i)
+        {
+            writeBitmap(bmp, *i);
+        }
+    });
+    measure("write png", pixels, images, min_time, [&]() {
+        for (Subtitle::subimages_t::const_iterator i(rgba.images.begin());
+             i != rgba.images.end(); ++i)
+        {
+            writePng(png, *i);
+        }
+    });
+    std::list<Subtitle> subs(1);
+    subs.front().width = options.width;
+    subs.front().height = options.height;
+    subs.front().images.swap(rgba.images);
+    measure("write sup", pixels, images, min_time, [&]() {
+        std::ostringstream out;
+        save_sup(&out, subs);
+    });
+
+    unlink(sup.c_str());
+    unlink(bmp.c_str());
+    unlink(png.c_str());
+    rmdir(dir);
+    return 0;
+}
@@ -1,36 +1,72 @@
-#include "format_sup.hpp"
+#include "subtitle.hpp"
+#include "bitmap.hpp"
+#include "byteorder.hpp"
+#include "stats.hpp"
 #include <fstream>
+#include <unordered_map>
+#include <vector>
+
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
+/* The headers are serialized into the start of the output buffer so the
+ * whole file goes out in one write. Sizes are known before any pixel is
+ * converted. */
+
 struct FileHeader {
-	FileHeader() :
-	   id1(0x42), id2(0x4d), fileSize(0), reserved(0), offset(54) 
+	static const u32 size = 14;
+
+	FileHeader(u32 fileSize, u32 offset) :
+	   id1(0x42), id2(0x4d), fileSize(fileSize), reserved(0), offset(offset)
 	{ }
 
+	u8* write(u8* out) const {
+		out[0] = id1;
+		out[1] = id2;
+		store_le32(out + 2, fileSize);
+		store_le32(out + 6, reserved);
+		store_le32(out + 10, offset);
+		return out + size;
+	}
+
 	//file header
 	u8 id1, id2;
 	u32 fileSize;
 	u32 reserved;
 	u32 offset;
 };
-ostream& operator<<(ostream& stream, FileHeader header) {
-	stream.write((const char*)&header.id1, 1);
-	stream.write((const char*)&header.id2, 1);
-	stream.write((const char*)&header.fileSize, 4);
-	stream.write((const char*)&header.reserved, 4);
-	stream.write((const char*)&header.offset, 4);
-	return stream;
-}
 
 struct DIBHeader {
-	DIBHeader(s32 w, s32 h) :
-	  headerSize(40), width(w), height(h),
+	static const u32 size = 40;
+
+	DIBHeader(s32 w, s32 h, u32 dataSize) :
+	  headerSize(size), width(w), height(h),
 	  numColourPanes(1), bitsPerPixel(32),
-	  compression(0) /* none */, dataSize(0), 
-	  horisontalRes(0), verticalRes(0), 
+	  compression(0) /* none */, dataSize(dataSize),
+	  horisontalRes(0), verticalRes(0),
 	  numColourInPalette(0), numImportColours(0)
 	{}
 
+	u8* write(u8* out) const {
+		store_le32(out, headerSize);
+		store_le32(out + 4, width);
+		store_le32(out + 8, height);
+		store_le16(out + 12, numColourPanes);
+		store_le16(out + 14, bitsPerPixel);
+		store_le32(out + 16, compression);
+		store_le32(out + 20, dataSize);
+		store_le32(out + 24, horisontalRes);
+		store_le32(out + 28, verticalRes);
+		store_le32(out + 32, numColourInPalette);
+		store_le32(out + 36, numImportColours);
+		return out + size;
+	}
+
 	//dib header
 	u32 headerSize;
 	s32 width;
@@ -44,64 +80,234 @@ struct DIBHeader {
 	u32 numColourInPalette;
 	u32 numImportColours;
 };
-ostream& operator<<(ostream& stream, DIBHeader header) {
-	stream.write((const char*)&header.headerSize, 4);
-	stream.write((const char*)&header.width, 4);
-	stream.write((const char*)&header.height, 4);
-	stream.write((const char*)&header.numColourPanes, 2);
-	stream.write((const char*)&header.bitsPerPixel, 2);
-	stream.write((const char*)&header.compression, 4);
-	stream.write((const char*)&header.dataSize, 4);
-	stream.write((const char*)&header.horisontalRes, 4);
-	stream.write((const char*)&header.verticalRes, 4);
-	stream.write((const char*)&header.numColourInPalette, 4);
-	stream.write((const char*)&header.numImportColours, 4);
-	return stream;
+
+enum {
+	BI_RGB = 0,
+	BI_RLE8 = 1
+};
+
+/* rgba is r << 24 | g << 16 | b << 8 | a, a BMP pixel is the bytes
+ * b g r 0, i.e. the little-endian word rgba >> 8 */
+static void rgba_row_to_bgr0(const u32* src, u8* dst, u32 width) {
+	u32 x = 0;
+#if defined(__GNUC__) && defined(__SSE2__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for(; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+		_mm_storeu_si128((__m128i*)(dst + x * 4), _mm_srli_epi32(v, 8));
+	}
+#endif
+	for(; x < width; ++x) {
+		store_le32(dst + x * 4, src[x] >> 8);
+	}
 }
 
-void writeFileHeader(ofstream& stream) {
-	stream <<FileHeader();
-	stream.flush();
+static void index_row_to_bgr0(const u8* src, const u32* palette, u8* dst, u32 width) {
+	for(u32 x = 0; x < width; ++x) {
+		store_le32(dst + x * 4, palette[src[x]] >> 8);
+	}
 }
 
-void writeDIBHeader(ofstream& stream, SubImage& sub) {
-	stream <<DIBHeader(sub.width, sub.height);
-	stream.flush();
+static inline void put_bgr(u8* dst, u32 rgba) {
+	dst[0] = rgba >> 8;
+	dst[1] = rgba >> 16;
+	dst[2] = rgba >> 24;
 }
 
-inline u32 rgba_to_bgr(u32 rgba) {
-	u8* data = new u8[4];
-	data[0] = (rgba & 0x0000FF00) >>8; //blue
-	data[1] = (rgba & 0x00FF0000) >>16; //green
-	data[2] = (rgba & 0xFF000000) >>24; //red
-	data[3] = 0x0;
-	u32 val = *(u32*)&data[0];
-	return val;
+static void rgba_row_to_bgr(const u32* src, u8* dst, u32 width) {
+	for(u32 x = 0; x < width; ++x) {
+		put_bgr(dst + x * 3, src[x]);
+	}
+}
+
+static void index_row_to_bgr(const u8* src, const u32* palette, u8* dst, u32 width) {
+	for(u32 x = 0; x < width; ++x) {
+		put_bgr(dst + x * 3, palette[src[x]]);
+	}
 }
 
-void writeImage(ofstream& stream, SubImage& sub) {
-	for(s32 y = sub.height-1; y >= 0 ; --y) {
-		for(u32 x = 0; x < sub.width; ++x) {
-			u32 bgr = rgba_to_bgr(sub.rgba[x+y*sub.width]);
-			stream.write((const char*)&bgr, 4);
+/* Maps an RGBA image onto its own colours, alpha is dropped like in the
+ * other formats. Returns false if there are more than 256. */
+static bool palettize(const SubImage& sub, std::vector<u8>& index,
+                      u32* palette, u32& colours) {
+	std::unordered_map<u32, u8> lookup;
+	const u32 count = sub.width * sub.height;
+	index.resize(count);
+	colours = 0;
+	u32 last = 0;
+	u8 last_index = 0;
+	for(u32 i = 0; i < count; ++i) {
+		const u32 rgb = sub.rgba[i] & 0xffffff00;
+		if(i > 0 && rgb == last) {
+			index[i] = last_index;
+			continue;
 		}
+		std::unordered_map<u32, u8>::const_iterator found = lookup.find(rgb);
+		if(found == lookup.end()) {
+			if(colours == 256)
+				return false;
+			palette[colours] = rgb;
+			found = lookup.insert(std::make_pair(rgb, (u8)colours++)).first;
+		}
+		last = rgb;
+		last_index = found->second;
+		index[i] = last_index;
+	}
+	return true;
+}
+
+/* One bottom-up row, terminated by an end of line. Runs of two or more use
+ * encoded mode, anything between them absolute mode when it is at least
+ * three pixels (shorter absolute runs are not allowed). */
+static u8* rle8_row(const u8* row, u32 width, u8* out) {
+	u32 x = 0;
+	while(x < width) {
+		u32 run = 1;
+		while(x + run < width && run < 255 && row[x + run] == row[x])
+			++run;
+		if(run >= 2) {
+			*out++ = run;
+			*out++ = row[x];
+			x += run;
+			continue;
+		}
+		u32 end = x + 1;
+		while(end < width && end - x < 255 &&
+		      !(end + 1 < width && row[end] == row[end + 1]))
+			++end;
+		const u32 n = end - x;
+		if(n >= 3) {
+			*out++ = 0;
+			*out++ = n;
+			memcpy(out, row + x, n);
+			out += n;
+			if(n & 1)
+				*out++ = 0;
+		} else {
+			for(u32 i = 0; i < n; ++i) {
+				*out++ = 1;
+				*out++ = row[x + i];
+			}
+		}
+		x = end;
 	}
-	stream.flush();
+	*out++ = 0;
+	*out++ = 0;
+	return out;
 }
 
-void writeFileSize(ofstream& stream, std::string path) {
-	ifstream reader(path.c_str(), ios::ate);
-	u32 size = reader.tellg();
-	stream.seekp(2);
-	stream.write((const char*)&size, 4);
-	stream.flush();
+bool parse_bitmap_format(const char* name, bitmap_format_t& format) {
+	if(strcmp(name, "32") == 0)
+		format = BITMAP_32;
+	else if(strcmp(name, "24") == 0)
+		format = BITMAP_24;
+	else if(strcmp(name, "8") == 0)
+		format = BITMAP_8;
+	else if(strcmp(name, "rle8") == 0)
+		format = BITMAP_RLE8;
+	else
+		return false;
+	return true;
 }
 
-void writeBitmap(std::string path, SubImage& sub) {
+bool writeBitmap(std::string path, const SubImage& sub, bitmap_format_t format) {
+	/* one set of buffers per writer thread, grown to the largest image
+	 * seen */
+	static thread_local std::vector<u8> buffer, indexBuffer;
+	StatTimer timer(STAT_TIME_WRITE);
+
+	const u8* index = sub.index;
+	const u32* palette = sub.palette;
+	u32 colours = 256, ownPalette[256];
+	if((format == BITMAP_8 || format == BITMAP_RLE8) && !sub.indexed()) {
+		if(palettize(sub, indexBuffer, ownPalette, colours)) {
+			index = indexBuffer.data();
+			palette = ownPalette;
+		} else {
+			format = BITMAP_24;
+		}
+	}
+
+	u16 bitsPerPixel;
+	u32 stride, maxDataSize, tableSize = 0;
+	switch(format) {
+	case BITMAP_24:
+		bitsPerPixel = 24;
+		stride = (sub.width * 3 + 3) & ~3u;
+		maxDataSize = stride * sub.height;
+		break;
+	case BITMAP_8:
+		bitsPerPixel = 8;
+		stride = (sub.width + 3) & ~3u;
+		maxDataSize = stride * sub.height;
+		tableSize = colours * 4;
+		break;
+	case BITMAP_RLE8:
+		/* no code takes more than two bytes per pixel */
+		bitsPerPixel = 8;
+		stride = 0;
+		maxDataSize = (sub.width * 2 + 2) * sub.height + 2;
+		tableSize = colours * 4;
+		break;
+	case BITMAP_32:
+	default:
+		bitsPerPixel = 32;
+		stride = sub.width * 4;
+		maxDataSize = stride * sub.height;
+		break;
+	}
+	const u32 offset = FileHeader::size + DIBHeader::size + tableSize;
+	buffer.assign(offset + maxDataSize, 0);
+
+	u8* table = buffer.data() + FileHeader::size + DIBHeader::size;
+	for(u32 i = 0; i < tableSize / 4; ++i)
+		store_le32(table + i * 4, palette[i] >> 8);
+
+	u8* out = buffer.data() + offset;
+	/* bottom-up rows, padding is already zero */
+	for(s32 y = sub.height - 1; y >= 0; --y, out += stride) {
+		const u32 row = y * sub.width;
+		switch(format) {
+		case BITMAP_24:
+			if(index != NULL)
+				index_row_to_bgr(index + row, palette, out, sub.width);
+			else
+				rgba_row_to_bgr(sub.rgba + row, out, sub.width);
+			break;
+		case BITMAP_8:
+			memcpy(out, index + row, sub.width);
+			break;
+		case BITMAP_RLE8:
+			out = rle8_row(index + row, sub.width, out);
+			break;
+		case BITMAP_32:
+		default:
+			if(index != NULL)
+				index_row_to_bgr0(index + row, palette, out, sub.width);
+			else
+				rgba_row_to_bgr0(sub.rgba + row, out, sub.width);
+			break;
+		}
+	}
+	if(format == BITMAP_RLE8) {
+		/* end of bitmap */
+		*out++ = 0;
+		*out++ = 1;
+	}
+	const u32 dataSize = out - (buffer.data() + offset);
+
+	DIBHeader dib(sub.width, sub.height, dataSize);
+	dib.bitsPerPixel = bitsPerPixel;
+	dib.compression = format == BITMAP_RLE8 ? BI_RLE8 : BI_RGB;
+	dib.numColourInPalette = tableSize / 4;
+	dib.write(FileHeader(offset + dataSize, offset).write(buffer.data()));
+
 	ofstream writer(path.c_str(), ios::trunc | ios::binary);
-	writeFileHeader(writer);
-	writeDIBHeader(writer, sub);
-	writeImage(writer, sub);
-	writeFileSize(writer, path);
+	writer.write((const char*)buffer.data(), offset + dataSize);
 	writer.close();
-}
\ No newline at end of file
+	if(writer.fail())
+		return false;
+	stat_add(STAT_FILES_WRITTEN);
+	stat_add(STAT_BYTES_WRITTEN, offset + dataSize);
+	return true;
+}
@@ -5,6 +5,22 @@
 
 class SubImage;
 
-void writeBitmap(std::string path, SubImage& sub);
+enum bitmap_format_t
+{
+    /* BGR with an unused fourth byte */
+    BITMAP_32,
+    BITMAP_24,
+    /* 8 bit with a colour table, uncompressed or BI_RLE8. RGBA images with
+     * more than 256 colours are written as BITMAP_24 instead. */
+    BITMAP_8,
+    BITMAP_RLE8,
+};
 
-#endif /* BITMAP_HPP */
\ No newline at end of file
+/* accepts 32, 24, 8 and rle8 */
+bool parse_bitmap_format(const char* name, bitmap_format_t& format);
+
+/* Returns false if the file could not be written */
+bool writeBitmap(std::string path, const SubImage& sub,
+                 bitmap_format_t format = BITMAP_32);
+
+#endif /* BITMAP_HPP */
@@ -0,0 +1,111 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <new>
+
+/* Requests up to this size share the smallest class */
+static const size_t MIN_BUFFER_SIZE = 256;
+
+BufferPool::BufferPool(size_t limit)
+    : limit_(limit), cached_(0), in_use_(0), peak_(0), free_(1 + 4 * (sizeof(size_t) * 8))
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (size_t i = 0; i < free_.size(); i++)
+    {
+        for (size_t j = 0; j < free_[i].size(); j++)
+        {
+            ::operator delete(free_[i][j]);
+        }
+    }
+}
+
+size_t BufferPool::size_class(size_t size, size_t& capacity)
+{
+    if (size <= MIN_BUFFER_SIZE)
+    {
+        capacity = MIN_BUFFER_SIZE;
+        return 0;
+    }
+    /* keep the top three bits of size - 1 and round up, the classes after
+     * 256 are 320, 384, 448, 512, 640 and so on */
+    const size_t top = size - 1;
+    const unsigned int shift = sizeof(unsigned long long) * 8 - 3 -
+                               __builtin_clzll(top);
+    const size_t steps = (top >> shift) + 1;
+    capacity = steps << shift;
+    return 1 + (shift - 6) * 4 + (steps - 5);
+}
+
+/* The inverse of size_class() */
+static size_t class_size(size_t cls)
+{
+    if (cls == 0)
+    {
+        return MIN_BUFFER_SIZE;
+    }
+    return ((cls - 1) % 4 + 5) << ((cls - 1) / 4 + 6);
+}
+
+void* BufferPool::acquire(size_t size, size_t& capacity)
+{
+    const size_t cls = size_class(size, capacity);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        /* a buffer up to a power of two larger beats a new one, image
+         * sizes vary too much for exact classes to hit often */
+        const size_t last = std::min(cls + 4, free_.size() - 1);
+        for (size_t i = cls; i <= last; i++)
+        {
+            std::vector<void*>& list = free_[i];
+            if (!list.empty())
+            {
+                void* ptr = list.back();
+                list.pop_back();
+                capacity = class_size(i);
+                cached_ -= capacity;
+                in_use_ += capacity;
+                return ptr;
+            }
+        }
+        in_use_ += capacity;
+        peak_ = std::max(peak_, in_use_ + cached_);
+    }
+    return ::operator new(capacity);
+}
+
+void BufferPool::release(void* ptr, size_t capacity)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    size_t rounded;
+    const size_t cls = size_class(capacity, rounded);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_use_ -= capacity;
+        if (cached_ + capacity <= limit_)
+        {
+            free_[cls].push_back(ptr);
+            cached_ += capacity;
+            return;
+        }
+    }
+    ::operator delete(ptr);
+}
+
+size_t BufferPool::peak()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+
+BufferPool& pixel_pool()
+{
+    /* two full HD RGBA frames */
+    static BufferPool pool(16 << 20);
+    return pool;
+}
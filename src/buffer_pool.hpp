@@ -0,0 +1,46 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include "common.hpp"
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/* Thread-safe free lists of pixel buffers. Sizes are rounded up to one of
+ * four classes per power of two, so a buffer fits any request within 25%
+ * of its size. A buffer released by one thread is handed to the next
+ * acquire of its class from any thread, which lets the decode, scale and
+ * write stages recycle each other's images. */
+class BufferPool
+{
+public:
+    /* at most limit bytes are kept around, the rest is freed */
+    explicit BufferPool(size_t limit);
+    ~BufferPool();
+
+    /* capacity is set to the real size, which release() needs back */
+    void* acquire(size_t size, size_t& capacity);
+    void release(void* ptr, size_t capacity);
+
+    /* most bytes ever held at once, handed out and cached together */
+    size_t peak();
+
+private:
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+
+    static size_t size_class(size_t size, size_t& capacity);
+
+    const size_t limit_;
+    size_t cached_;
+    size_t in_use_;
+    size_t peak_;
+    std::vector<std::vector<void*> > free_;
+    std::mutex mutex_;
+};
+
+/* shared by all SubImage pixels */
+BufferPool& pixel_pool();
+
+#endif /* BUFFER_POOL_HPP */
@@ -0,0 +1,76 @@
+#ifndef BYTEORDER_HPP
+#define BYTEORDER_HPP
+
+#include "common.hpp"
+
+/* Big- and little-endian loads and stores on unaligned byte pointers.
+ * Composed from single bytes so they are independent of host byte order,
+ * the compiler turns them into a single load and bswap. */
+
+static inline u16 load_be16(const u8* p)
+{
+    return (u16)((p[0] << 8) | p[1]);
+}
+
+static inline u32 load_be24(const u8* p)
+{
+    return ((u32)p[0] << 16) | ((u32)p[1] << 8) | p[2];
+}
+
+static inline u32 load_be32(const u8* p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static inline void store_be16(u8* p, u16 x)
+{
+    p[0] = x >> 8;
+    p[1] = x;
+}
+
+static inline void store_be24(u8* p, u32 x)
+{
+    p[0] = x >> 16;
+    p[1] = x >> 8;
+    p[2] = x;
+}
+
+static inline void store_be32(u8* p, u32 x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static inline u32 load_le32(const u8* p)
+{
+    return ((u32)p[3] << 24) | ((u32)p[2] << 16) | ((u32)p[1] << 8) | p[0];
+}
+
+static inline u64 load_le64(const u8* p)
+{
+    return ((u64)load_le32(p + 4) << 32) | load_le32(p);
+}
+
+static inline void store_le16(u8* p, u16 x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+}
+
+static inline void store_le32(u8* p, u32 x)
+{
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+static inline void store_le64(u8* p, u64 x)
+{
+    store_le32(p, x);
+    store_le32(p + 4, x >> 32);
+}
+
+#endif /* BYTEORDER_HPP */
@@ -0,0 +1,99 @@
+#include "colorspace.hpp"
+
+#include <cstring>
+
+namespace {
+
+/* Per component contributions in 8 bit fixed point, so a channel is
+ * (y + chroma terms) >> 8. The rounding bias is folded into the luma
+ * table. */
+struct YCbCrTable
+{
+    s32 y[256];
+    s32 r_cr[256], g_cb[256], g_cr[256], b_cb[256];
+};
+
+constexpr s32 round_fixed(double v)
+{
+    return (s32)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+constexpr YCbCrTable make_table(double r_cr, double g_cb, double g_cr, double b_cb)
+{
+    YCbCrTable table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        table.y[i] = round_fixed(298.082 * (i - 16)) + 128;
+        table.r_cr[i] = round_fixed(r_cr * (i - 128));
+        table.g_cb[i] = round_fixed(g_cb * (i - 128));
+        table.g_cr[i] = round_fixed(g_cr * (i - 128));
+        table.b_cb[i] = round_fixed(b_cb * (i - 128));
+    }
+    return table;
+}
+
+/* Kb = 0.114, Kr = 0.299 */
+constexpr YCbCrTable bt601 = make_table(408.583, -100.291, -208.120, 516.412);
+/* Kb = 0.0722, Kr = 0.2126 */
+constexpr YCbCrTable bt709 = make_table(458.942, -54.592, -136.425, 540.775);
+
+inline u32 clamp8(s32 v)
+{
+    v >>= 8;
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+inline u8 round_clamp(double v, double low, double high)
+{
+    return (u8)(v < low ? low : (v > high ? high : v + 0.5));
+}
+
+}
+
+color_matrix_t color_matrix_for(u32 width, u32 height)
+{
+    return (width > 1024 || height >= 720) ? COLOR_MATRIX_BT709 : COLOR_MATRIX_BT601;
+}
+
+bool parse_color_matrix(const char* name, color_matrix_t& matrix)
+{
+    if (std::strcmp(name, "auto") == 0)
+    {
+        matrix = COLOR_MATRIX_AUTO;
+    }
+    else if (std::strcmp(name, "601") == 0)
+    {
+        matrix = COLOR_MATRIX_BT601;
+    }
+    else if (std::strcmp(name, "709") == 0)
+    {
+        matrix = COLOR_MATRIX_BT709;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+u32 ycbcr_to_rgb(u8 y, u8 cb, u8 cr, color_matrix_t matrix)
+{
+    const YCbCrTable& t = matrix == COLOR_MATRIX_BT601 ? bt601 : bt709;
+    const s32 l = t.y[y];
+    return clamp8(l + t.r_cr[cr]) << 24 |
+        clamp8(l + t.g_cb[cb] + t.g_cr[cr]) << 16 |
+        clamp8(l + t.b_cb[cb]) << 8;
+}
+
+void rgb_to_ycbcr(u32 rgba, color_matrix_t matrix, u8& y, u8& cb, u8& cr)
+{
+    const double kr = matrix == COLOR_MATRIX_BT601 ? 0.299 : 0.2126;
+    const double kb = matrix == COLOR_MATRIX_BT601 ? 0.114 : 0.0722;
+    const double r = (rgba >> 24) & 0xff;
+    const double g = (rgba >> 16) & 0xff;
+    const double b = (rgba >> 8) & 0xff;
+    const double l = kr * r + (1 - kr - kb) * g + kb * b;
+    y = round_clamp(16 + l * 219 / 255, 16, 235);
+    cb = round_clamp(128 + (b - l) / (2 * (1 - kb)) * 224 / 255, 16, 240);
+    cr = round_clamp(128 + (r - l) / (2 * (1 - kr)) * 224 / 255, 16, 240);
+}
@@ -0,0 +1,28 @@
+#ifndef COLORSPACE_HPP
+#define COLORSPACE_HPP
+
+#include "common.hpp"
+
+enum color_matrix_t
+{
+    /* pick from the frame size, see color_matrix_for() */
+    COLOR_MATRIX_AUTO,
+    COLOR_MATRIX_BT601,
+    COLOR_MATRIX_BT709,
+};
+
+/* BT.601 for SD frame heights, BT.709 for HD */
+color_matrix_t color_matrix_for(u32 width, u32 height);
+
+/* accepts auto, 601 and 709 */
+bool parse_color_matrix(const char* name, color_matrix_t& matrix);
+
+/* Limited range YCbCr to RGB packed as r << 24 | g << 16 | b << 8,
+ * clamped to 0 - 255. matrix must not be COLOR_MATRIX_AUTO. */
+u32 ycbcr_to_rgb(u8 y, u8 cb, u8 cr, color_matrix_t matrix);
+
+/* Inverse of ycbcr_to_rgb, alpha is ignored. Only used for palettes so it
+ * computes in floating point. */
+void rgb_to_ycbcr(u32 rgba, color_matrix_t matrix, u8& y, u8& cb, u8& cr);
+
+#endif /* COLORSPACE_HPP */
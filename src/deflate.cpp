@@ -0,0 +1,490 @@
+#include "deflate.hpp"
+#include "byteorder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+namespace {
+
+constexpr unsigned int WINDOW_SIZE = 32768;
+constexpr unsigned int MIN_MATCH = 3;
+constexpr unsigned int MAX_MATCH = 258;
+constexpr unsigned int HASH_BITS = 15;
+/* candidates looked at per position, more compresses better but slower */
+constexpr unsigned int MAX_CHAIN = 8;
+/* matches longer than this only hash their last positions */
+constexpr unsigned int MAX_INSERT = 16;
+/* tokens per block, each block gets its own Huffman codes */
+constexpr size_t BLOCK_TOKENS = 1 << 16;
+
+constexpr unsigned int LITERALS = 286;
+constexpr unsigned int DISTANCES = 30;
+constexpr unsigned int CODE_LENGTHS = 19;
+constexpr unsigned int END_OF_BLOCK = 256;
+
+constexpr u16 length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+constexpr u8 length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+constexpr u16 distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577
+};
+constexpr u8 distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+constexpr u8 code_length_order[CODE_LENGTHS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Length and distance to code lookups. Distances above 256 are looked up
+ * in steps of 128, the codes there cover multiples of 128. */
+struct CodeTables
+{
+    u8 length[MAX_MATCH + 1];
+    u8 distance_low[256];
+    u8 distance_high[256];
+};
+
+constexpr CodeTables make_code_tables()
+{
+    CodeTables t = {};
+    for (unsigned int code = 0; code < 29; code++)
+    {
+        for (unsigned int len = length_base[code];
+             len < length_base[code] + (1u << length_extra[code]) && len <= MAX_MATCH;
+             len++)
+        {
+            t.length[len] = code;
+        }
+    }
+    for (unsigned int code = 0; code < DISTANCES; code++)
+    {
+        const unsigned int end = distance_base[code] + (1u << distance_extra[code]);
+        for (unsigned int dist = distance_base[code]; dist < end; dist++)
+        {
+            if (dist <= 256)
+            {
+                t.distance_low[dist - 1] = code;
+            }
+            else if (((dist - 1) & 127) == 0)
+            {
+                t.distance_high[(dist - 1) >> 7] = code;
+            }
+        }
+    }
+    return t;
+}
+
+constexpr CodeTables code_tables = make_code_tables();
+
+inline unsigned int distance_code(unsigned int dist)
+{
+    return dist <= 256 ? code_tables.distance_low[dist - 1]
+        : code_tables.distance_high[(dist - 1) >> 7];
+}
+
+/* A literal byte, or a match as length << 16 | (distance - 1) */
+typedef u32 token_t;
+
+inline token_t match_token(unsigned int length, unsigned int dist)
+{
+    return (length << 16) | (dist - 1);
+}
+
+class BitWriter
+{
+public:
+    BitWriter(std::vector<u8>& out)
+        : out_(out), bits_(0), count_(0)
+    {
+    }
+
+    /* value is written least significant bit first */
+    void put(u32 value, unsigned int n)
+    {
+        bits_ |= (u64)value << count_;
+        count_ += n;
+        while (count_ >= 8)
+        {
+            out_.push_back(bits_);
+            bits_ >>= 8;
+            count_ -= 8;
+        }
+    }
+
+    void flush()
+    {
+        if (count_ > 0)
+        {
+            out_.push_back(bits_);
+        }
+        bits_ = 0;
+        count_ = 0;
+    }
+
+private:
+    std::vector<u8>& out_;
+    u64 bits_;
+    unsigned int count_;
+};
+
+/* Huffman code lengths for freq, limited to max_length bits. Frequencies
+ * are flattened until the tree is shallow enough. At least two symbols
+ * get a code so the code is always complete. */
+void build_lengths(const u32* freq, unsigned int n, unsigned int max_length,
+                   u8* lengths)
+{
+    std::vector<u32> f(freq, freq + n);
+    unsigned int used = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        used += f[i] != 0;
+    }
+    for (unsigned int i = 0; used < 2 && i < n; i++)
+    {
+        if (f[i] == 0)
+        {
+            f[i] = 1;
+            used++;
+        }
+    }
+
+    std::vector<u32> parent(2 * n);
+    while (true)
+    {
+        typedef std::pair<u32, u32> node_t; /* weight, node */
+        std::priority_queue<node_t, std::vector<node_t>,
+                            std::greater<node_t> > heap;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            if (f[i] != 0)
+            {
+                heap.push(node_t(f[i], i));
+            }
+        }
+        u32 next = n;
+        while (heap.size() > 1)
+        {
+            node_t a = heap.top();
+            heap.pop();
+            node_t b = heap.top();
+            heap.pop();
+            parent[a.second] = next;
+            parent[b.second] = next;
+            heap.push(node_t(a.first + b.first, next++));
+        }
+        const u32 root = next - 1;
+        /* parents are numbered after their children, so depths are filled
+         * from the root down */
+        std::vector<u8> depth(next, 0);
+        for (u32 node = root; node-- > n; )
+        {
+            depth[node] = depth[parent[node]] + 1;
+        }
+        unsigned int longest = 0;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            lengths[i] = f[i] != 0 ? depth[parent[i]] + 1 : 0;
+            longest = std::max<unsigned int>(longest, lengths[i]);
+        }
+        if (longest <= max_length)
+        {
+            return;
+        }
+        for (unsigned int i = 0; i < n; i++)
+        {
+            if (f[i] != 0)
+            {
+                f[i] = (f[i] >> 1) | 1;
+            }
+        }
+    }
+}
+
+/* Canonical codes for lengths, bit reversed for the LSB first writer */
+void build_codes(const u8* lengths, unsigned int n, u16* codes)
+{
+    u16 count[16] = { 0 }, next[16];
+    for (unsigned int i = 0; i < n; i++)
+    {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+    u16 code = 0;
+    for (unsigned int bits = 1; bits < 16; bits++)
+    {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (unsigned int i = 0; i < n; i++)
+    {
+        const unsigned int len = lengths[i];
+        if (len == 0)
+        {
+            continue;
+        }
+        u16 c = next[len]++, reversed = 0;
+        for (unsigned int b = 0; b < len; b++)
+        {
+            reversed = (reversed << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = reversed;
+    }
+}
+
+void write_block(BitWriter& bits, const std::vector<token_t>& tokens, bool final)
+{
+    u32 lit_freq[LITERALS] = { 0 }, dist_freq[DISTANCES] = { 0 };
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        const token_t t = tokens[i];
+        if (t < 256)
+        {
+            lit_freq[t]++;
+        }
+        else
+        {
+            lit_freq[257 + code_tables.length[t >> 16]]++;
+            dist_freq[distance_code((t & 0xffff) + 1)]++;
+        }
+    }
+    lit_freq[END_OF_BLOCK] = 1;
+
+    u8 lit_lengths[LITERALS], dist_lengths[DISTANCES];
+    build_lengths(lit_freq, LITERALS, 15, lit_lengths);
+    build_lengths(dist_freq, DISTANCES, 15, dist_lengths);
+    unsigned int hlit = LITERALS, hdist = DISTANCES;
+    while (hlit > 257 && lit_lengths[hlit - 1] == 0)
+    {
+        hlit--;
+    }
+    while (hdist > 1 && dist_lengths[hdist - 1] == 0)
+    {
+        hdist--;
+    }
+    /* both lengths are sent as one sequence */
+    u8 lengths[LITERALS + DISTANCES];
+    std::memcpy(lengths, lit_lengths, hlit);
+    std::memcpy(lengths + hlit, dist_lengths, hdist);
+    const unsigned int total = hlit + hdist;
+
+    /* run-length code the lengths: 16 repeats the previous length 3-6
+     * times, 17 and 18 are 3-10 and 11-138 zeroes */
+    std::vector<u16> rle; /* symbol | extra << 8 */
+    u32 cl_freq[CODE_LENGTHS] = { 0 };
+    for (unsigned int i = 0; i < total; )
+    {
+        const u8 len = lengths[i];
+        unsigned int run = 1;
+        while (i + run < total && lengths[i + run] == len)
+        {
+            run++;
+        }
+        if (len == 0 && run >= 3)
+        {
+            run = std::min(run, 138u);
+            if (run <= 10)
+            {
+                rle.push_back(17 | (run - 3) << 8);
+                cl_freq[17]++;
+            }
+            else
+            {
+                rle.push_back(18 | (run - 11) << 8);
+                cl_freq[18]++;
+            }
+        }
+        else if (len != 0 && run >= 4)
+        {
+            rle.push_back(len);
+            cl_freq[len]++;
+            run = std::min(run - 1, 6u);
+            rle.push_back(16 | (run - 3) << 8);
+            cl_freq[16]++;
+            run++;
+        }
+        else
+        {
+            run = 1;
+            rle.push_back(len);
+            cl_freq[len]++;
+        }
+        i += run;
+    }
+
+    u8 cl_lengths[CODE_LENGTHS];
+    u16 cl_codes[CODE_LENGTHS];
+    build_lengths(cl_freq, CODE_LENGTHS, 7, cl_lengths);
+    build_codes(cl_lengths, CODE_LENGTHS, cl_codes);
+    unsigned int hclen = CODE_LENGTHS;
+    while (hclen > 4 && cl_lengths[code_length_order[hclen - 1]] == 0)
+    {
+        hclen--;
+    }
+
+    bits.put(final ? 1 : 0, 1);
+    bits.put(2, 2); /* dynamic Huffman */
+    bits.put(hlit - 257, 5);
+    bits.put(hdist - 1, 5);
+    bits.put(hclen - 4, 4);
+    for (unsigned int i = 0; i < hclen; i++)
+    {
+        bits.put(cl_lengths[code_length_order[i]], 3);
+    }
+    static const u8 rle_extra[3] = { 2, 3, 7 };
+    for (size_t i = 0; i < rle.size(); i++)
+    {
+        const unsigned int sym = rle[i] & 0xff;
+        bits.put(cl_codes[sym], cl_lengths[sym]);
+        if (sym >= 16)
+        {
+            bits.put(rle[i] >> 8, rle_extra[sym - 16]);
+        }
+    }
+
+    u16 lit_codes[LITERALS], dist_codes[DISTANCES];
+    build_codes(lit_lengths, LITERALS, lit_codes);
+    build_codes(dist_lengths, DISTANCES, dist_codes);
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        const token_t t = tokens[i];
+        if (t < 256)
+        {
+            bits.put(lit_codes[t], lit_lengths[t]);
+            continue;
+        }
+        const unsigned int len = t >> 16, dist = (t & 0xffff) + 1;
+        const unsigned int lc = code_tables.length[len];
+        bits.put(lit_codes[257 + lc], lit_lengths[257 + lc]);
+        bits.put(len - length_base[lc], length_extra[lc]);
+        const unsigned int dc = distance_code(dist);
+        bits.put(dist_codes[dc], dist_lengths[dc]);
+        bits.put(dist - distance_base[dc], distance_extra[dc]);
+    }
+    bits.put(lit_codes[END_OF_BLOCK], lit_lengths[END_OF_BLOCK]);
+}
+
+inline u32 hash3(const u8* p)
+{
+    const u32 v = (u32)p[0] | (u32)p[1] << 8 | (u32)p[2] << 16;
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+u32 adler32(const u8* data, size_t size)
+{
+    u32 a = 1, b = 0;
+    while (size > 0)
+    {
+        /* largest n where b cannot overflow before the modulo */
+        size_t n = std::min<size_t>(size, 5552);
+        size -= n;
+        while (n-- > 0)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+}
+
+void zlib_compress(const u8* data, size_t size, std::vector<u8>& out)
+{
+    /* deflate, 32K window, no dictionary, fastest level */
+    out.push_back(0x78);
+    out.push_back(0x01);
+
+    BitWriter bits(out);
+    std::vector<s32> head(1 << HASH_BITS, -1);
+    std::vector<s32> prev(WINDOW_SIZE);
+    std::vector<token_t> tokens;
+    tokens.reserve(BLOCK_TOKENS);
+
+    size_t pos = 0;
+    while (pos < size)
+    {
+        unsigned int best_len = 0, best_dist = 0;
+        if (pos + MIN_MATCH <= size)
+        {
+            const u32 h = hash3(data + pos);
+            const unsigned int max_len = std::min<size_t>(MAX_MATCH, size - pos);
+            s32 cand = head[h];
+            for (unsigned int chain = 0; chain < MAX_CHAIN && cand >= 0 &&
+                     pos - cand <= WINDOW_SIZE; chain++)
+            {
+                const u8* a = data + cand;
+                const u8* b = data + pos;
+                if (a[best_len] == b[best_len])
+                {
+                    unsigned int len = 0;
+                    while (len < max_len && a[len] == b[len])
+                    {
+                        len++;
+                    }
+                    if (len > best_len)
+                    {
+                        best_len = len;
+                        best_dist = pos - cand;
+                        if (len == max_len)
+                        {
+                            break;
+                        }
+                    }
+                }
+                cand = prev[cand & (WINDOW_SIZE - 1)];
+            }
+            prev[pos & (WINDOW_SIZE - 1)] = head[h];
+            head[h] = pos;
+        }
+
+        if (best_len >= MIN_MATCH)
+        {
+            tokens.push_back(match_token(best_len, best_dist));
+            /* the current position is already hashed */
+            size_t first = pos + 1;
+            const size_t end = pos + best_len;
+            if (best_len > MAX_INSERT)
+            {
+                first = end - 2;
+            }
+            for (size_t i = first; i < end && i + MIN_MATCH <= size; i++)
+            {
+                const u32 h = hash3(data + i);
+                prev[i & (WINDOW_SIZE - 1)] = head[h];
+                head[h] = i;
+            }
+            pos = end;
+        }
+        else
+        {
+            tokens.push_back(data[pos++]);
+        }
+
+        if (tokens.size() == BLOCK_TOKENS)
+        {
+            write_block(bits, tokens, pos == size);
+            tokens.clear();
+        }
+    }
+    if (!tokens.empty() || size == 0)
+    {
+        write_block(bits, tokens, true);
+    }
+    bits.flush();
+
+    u8 checksum[4];
+    store_be32(checksum, adler32(data, size));
+    out.insert(out.end(), checksum, checksum + 4);
+}
@@ -0,0 +1,15 @@
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include "common.hpp"
+
+#include <cstddef>
+#include <vector>
+
+/* Appends data as a zlib stream (RFC 1950) to out. The deflate side is
+ * tuned for speed on subtitle bitmaps: a short hash chain finds the long
+ * runs of transparent pixels and repeated rows, each block gets its own
+ * Huffman codes. */
+void zlib_compress(const u8* data, size_t size, std::vector<u8>& out);
+
+#endif /* DEFLATE_HPP */
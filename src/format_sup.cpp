@@ -1,76 +1,24 @@
 #include "common.hpp"
 
 #include "format_sup.hpp"
-
+#include "byteorder.hpp"
+#include "colorspace.hpp"
+#include "mapped_file.hpp"
+#include "scale.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
 #include <map>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <cstring>
 
-static bool read_segments(std::istream* in, Subtitle& subtitle);
-
-bool load_sup(std::istream* in, std::list<Subtitle>& subs)
-{
-    unsigned int count = 0;
-    while (!in->eof() && !in->fail())
-    {
-        Subtitle subtitle;
-        if (!read_segments(in, subtitle))
-        {
-            return false;
-        }
-        subs.push_back(subtitle);
-    }
-    return count > 0 && !in->bad();
-}
-
-bool save_sup(std::ostream* out, std::list<Subtitle>& subs)
-{
-    return false;
-}
-
-static inline u8 readu8(std::istream* in)
-{
-    u8 ret;
-    in->read(reinterpret_cast<char*>(&ret), sizeof(ret));
-    return ret;
-}
-
-static inline u16 readu16(std::istream* in)
-{
-    u16 ret;
-    in->read(reinterpret_cast<char*>(&ret), sizeof(ret));
-#ifdef WORDS_BIGENDIAN
-    return ret;
-#else
-    return (ret >> 8) | ((ret & 0xff) << 8);
-#endif
-}
-
-static inline u32 readu24(std::istream* in)
-{
-    u8 x = readu8(in);
-    u16 y = readu16(in);
-#ifdef WORDS_BIGENDIAN
-    return (x << 16) | y;
-#else
-    return x | (y << 8);
-#endif
-}
-
-static inline u32 readu32(std::istream* in)
-{
-    u32 ret;
-    in->read(reinterpret_cast<char*>(&ret), sizeof(ret));
-#ifdef WORDS_BIGENDIAN
-    return ret;
-#else
-    return (ret >> 24) | ((ret & 0xff0000) >> 8) | ((ret & 0xff00) << 8) |
-        ((ret & 0xff) << 24);
-#endif
-}
-
 enum segment_type_t
 {
     SEGMENT_TYPE_PALETTE = 0x14,
@@ -80,37 +28,30 @@ enum segment_type_t
     SEGMENT_TYPE_END = 0x80,
 };
 
-class PaletteEntry
-{
-public:
-    u8 index;
-    u8 y, cr, cb, alpha;
-};
-
-#ifdef DEBUG_OUTPUT
-static std::ostream& operator<<(std::ostream& out, const PaletteEntry& entry)
-{
-    return out << "[#" << (int)entry.index << " Y:" << (int)entry.y << " Cr:" << (int)entry.cr << " Cb:" << (int)entry.cb << " A:" << (int)entry.alpha << ']';
-}
-#endif
-
 class Palette
 {
 public:
+    Palette()
+        : matrix(COLOR_MATRIX_AUTO)
+    {
+    }
+
     u8 id, version;
-    typedef std::list<PaletteEntry> entry_list;
-    entry_list entries;
+    /* Y << 24 | Cr << 16 | Cb << 8 | alpha by index, only those with
+     * their bit set in defined were in the segment */
+    u32 entries[256];
+    u64 defined[4];
+
+    /* entries converted to RGBA with matrix, COLOR_MATRIX_AUTO until the
+     * first use */
+    color_matrix_t matrix;
+    u32 rgba[256];
 };
 
 #ifdef DEBUG_OUTPUT
 static std::ostream& operator<<(std::ostream& out, const Palette& pal)
 {
-    out << "{id:" << (int)pal.id << "/" << (int)pal.version << " entries:";
-    // for (Palette::entry_list::const_iterator i(pal.entries.begin()); i != pal.entries.end(); i++)
-    // {
-    //     out << *i << ',';
-    // }
-    return out << '}';
+    return out << "{id:" << (int)pal.id << "/" << (int)pal.version << '}';
 }
 #endif
 
@@ -155,17 +96,230 @@ private:
     unsigned int ref;
 };
 
+/* The header and payload of one segment. data stays valid until the next
+ * call to SegmentReader::next(), owner can be retained to keep it longer. */
+class Segment
+{
+public:
+    u32 presentation, decoding;
+    u8 type;
+    u16 length;
+    const u8* data;
+    /* NULL when data points into a mapped file */
+    RefData<u8>* owner;
+};
+
+static const unsigned int SEGMENT_HEADER_SIZE = 13;
+
+class SegmentReader
+{
+public:
+    virtual ~SegmentReader()
+    {
+    }
+
+    /* Returns false at end of input or on error, check bad() */
+    virtual bool next(Segment& segment) = 0;
+
+    /* Continues at the segment starting offset bytes into the input */
+    virtual bool seek(u64 offset) = 0;
+
+    bool bad() const
+    {
+        return bad_;
+    }
+
+    static bool parse_header(const u8* ptr, Segment& segment)
+    {
+        if (ptr[0] != 'P' || ptr[1] != 'G')
+        {
+            return false;
+        }
+        segment.presentation = load_be32(ptr + 2);
+        segment.decoding = load_be32(ptr + 6);
+        segment.type = ptr[10];
+        segment.length = load_be16(ptr + 11);
+        return true;
+    }
+
+protected:
+    SegmentReader()
+        : bad_(false)
+    {
+    }
+
+    static void count(const Segment& segment)
+    {
+        stat_counter_t counter;
+        switch (segment.type)
+        {
+        case SEGMENT_TYPE_PALETTE:
+            counter = STAT_SEGMENTS_PALETTE;
+            break;
+        case SEGMENT_TYPE_IMAGE:
+            counter = STAT_SEGMENTS_IMAGE;
+            break;
+        case SEGMENT_TYPE_TIMECODES:
+            counter = STAT_SEGMENTS_TIMECODES;
+            break;
+        case SEGMENT_TYPE_WINDOW:
+            counter = STAT_SEGMENTS_WINDOW;
+            break;
+        case SEGMENT_TYPE_END:
+            counter = STAT_SEGMENTS_END;
+            break;
+        default:
+            counter = STAT_SEGMENTS_OTHER;
+            break;
+        }
+        stat_add(counter);
+        stat_add(STAT_BYTES_READ, SEGMENT_HEADER_SIZE + segment.length);
+        stat_position(segment.presentation);
+    }
+
+    bool bad_;
+};
+
+/* Segments as views into a memory mapped file, no copying */
+class MappedSegmentReader : public SegmentReader
+{
+public:
+    MappedSegmentReader(const u8* data, u64 size)
+        : data_(data), size_(size), pos_(0)
+    {
+    }
+
+    bool next(Segment& segment)
+    {
+        if (pos_ == size_ || bad_)
+        {
+            return false;
+        }
+        if (size_ - pos_ < SEGMENT_HEADER_SIZE ||
+            !parse_header(data_ + pos_, segment) ||
+            size_ - pos_ - SEGMENT_HEADER_SIZE < segment.length)
+        {
+            std::cerr << "bad segment" << std::endl;
+            bad_ = true;
+            return false;
+        }
+        segment.data = data_ + pos_ + SEGMENT_HEADER_SIZE;
+        segment.owner = NULL;
+        pos_ += SEGMENT_HEADER_SIZE + segment.length;
+        count(segment);
+        return true;
+    }
+
+    bool seek(u64 offset)
+    {
+        if (offset > size_)
+        {
+            return false;
+        }
+        pos_ = offset;
+        return true;
+    }
+
+private:
+    const u8* data_;
+    u64 size_;
+    u64 pos_;
+};
+
+/* Fallback for pipes and other unmappable input, reads each segment with
+ * one read for the header and one for the payload. Image payloads get a
+ * buffer of their own so they can outlive the segment. */
+class StreamSegmentReader : public SegmentReader
+{
+public:
+    StreamSegmentReader(std::istream* in)
+        : in_(in), owner_(NULL)
+    {
+    }
+
+    ~StreamSegmentReader()
+    {
+        drop_owner();
+    }
+
+    bool next(Segment& segment)
+    {
+        u8 header[SEGMENT_HEADER_SIZE];
+        drop_owner();
+        if (bad_)
+        {
+            return false;
+        }
+        in_->read(reinterpret_cast<char*>(header), sizeof(header));
+        if (in_->gcount() == 0 && in_->eof())
+        {
+            return false;
+        }
+        if (in_->fail() || !parse_header(header, segment))
+        {
+            std::cerr << "bad segment" << std::endl;
+            bad_ = true;
+            return false;
+        }
+        u8* ptr;
+        if (segment.type == SEGMENT_TYPE_IMAGE)
+        {
+            owner_ = new RefData<u8>(new u8[segment.length]);
+            ptr = owner_->ptr;
+        }
+        else
+        {
+            buffer_.resize(segment.length);
+            ptr = buffer_.empty() ? NULL : &buffer_[0];
+        }
+        in_->read(reinterpret_cast<char*>(ptr), segment.length);
+        if (in_->fail())
+        {
+            std::cerr << "bad segment" << std::endl;
+            bad_ = true;
+            return false;
+        }
+        segment.data = ptr;
+        segment.owner = owner_;
+        count(segment);
+        return true;
+    }
+
+    bool seek(u64 offset)
+    {
+        drop_owner();
+        in_->clear();
+        in_->seekg(offset);
+        return !in_->fail();
+    }
+
+private:
+    void drop_owner()
+    {
+        if (owner_ != NULL)
+        {
+            owner_->release();
+            owner_ = NULL;
+        }
+    }
+
+    std::istream* in_;
+    RefData<u8>* owner_;
+    std::vector<u8> buffer_;
+};
+
 class Image
 {
 public:
     Image()
-        : data(NULL)
+        : ptr(NULL), data(NULL)
     {
     }
 
     Image(const Image& img)
     : id(img.id), version(img.version), flags(img.flags), width(img.width),
-      height(img.height), total(img.total), size(img.size), data(img.data)
+      height(img.height), total(img.total), size(img.size), ptr(img.ptr),
+      data(img.data)
     {
         if (data != NULL)
         {
@@ -181,6 +335,28 @@ public:
         }
     }
 
+    Image& operator=(const Image& img)
+    {
+        if (img.data != NULL)
+        {
+            img.data->retain();
+        }
+        if (data != NULL)
+        {
+            data->release();
+        }
+        id = img.id;
+        version = img.version;
+        flags = img.flags;
+        width = img.width;
+        height = img.height;
+        total = img.total;
+        size = img.size;
+        ptr = img.ptr;
+        data = img.data;
+        return *this;
+    }
+
     u16 id;
     u8 version;
     u8 flags;
@@ -189,6 +365,8 @@ public:
     u32 total;
 
     u16 size;
+    const u8* ptr;
+    /* owner of ptr, NULL when ptr points into a mapped file */
     RefData<u8>* data;
 };
 
@@ -227,6 +405,9 @@ public:
     u8 window_id;
     u8 flags;
     u16 x, y;
+    /* with OBJ_FLAG_CROPPED only this part of the object is shown, its
+     * top left corner at x, y */
+    u16 crop_x, crop_y, crop_width, crop_height;
 };
 
 #ifdef DEBUG_OUTPUT
@@ -256,13 +437,20 @@ enum timecode_composition_state_t
 class Timecode
 {
 public:
+    Timecode()
+        : width(0), height(0), fps(TIMECODE_FPS_UNKNOWN), comp_num(0),
+          comp_state(0), palette_flags(0), palette_id(0), presentation(0),
+          decoding(0)
+    {
+    }
+
     u16 width, height;
     fps_t fps;
     u16 comp_num;
     u8 comp_state;
     u8 palette_flags;
     u8 palette_id;
-    typedef std::list<Object> object_list;
+    typedef std::vector<Object> object_list;
     object_list objects;
 
     u32 presentation, decoding;
@@ -294,553 +482,2443 @@ static std::ostream& operator<<(std::ostream& out, const Timecode& tc)
 }
 #endif
 
-static bool read_palette(std::istream* in, Palette& palette, u16 length);
-static bool read_image(std::istream* in, Image& image, u16 length);
-static long read_window(std::istream* in, Window& window, u16 length);
-static bool read_timecode(std::istream* in, Timecode& timecode, u16 length);
-static long read_object(std::istream* in, Object& object, u16 length);
-
-typedef std::vector<Palette> palette_list;
-typedef std::map<u8, palette_list> palette_map;
-
-typedef std::vector<Image> image_list;
-typedef std::map<u16, image_list> image_map;
-
-typedef std::vector<Window> window_list;
+static bool read_palette(const u8* in, Palette& palette, u16 length);
+static bool read_image(const u8* in, Image& image, u16 length);
+static long read_window(const u8* in, Window& window, u16 length);
+static bool read_timecode(const u8* in, Timecode& timecode, u16 length);
+static long read_object(const u8* in, Object& object, u16 length);
 
-typedef std::list<Timecode> timecode_list;
-
-struct entry
+/* Values by u8 id in 256 fixed slots. Only the ids in use are visited
+ * by clear() and by merges, a slot keeps its memory when it is reused. */
+template<typename T>
+class IdTable
 {
-    palette_map palettes;
-    image_map images;
-    window_list windows;
-    timecode_list timecodes;
-};
+public:
+    IdTable()
+        : slots_(256)
+    {
+        std::memset(used_, 0, sizeof(used_));
+        ids_.reserve(256);
+    }
 
-static bool create_subimage(Subtitle& subtitle, entry& last, entry& current);
+    T* find(u8 id)
+    {
+        return used_[id] ? &slots_[id] : NULL;
+    }
 
-bool read_segments(std::istream* in, Subtitle& subtitle)
-{
-    unsigned int start = subtitle.images.size();
-    entry last, current;
-    for (;;)
+    /* adds id if it is not there yet, the slot keeps its old value */
+    T& operator[](u8 id)
     {
-        char id[2];
-        u32 presentation;
-        u32 decoding;
-        u8 type;
-        u16 length;
-        in->read(id, sizeof(id));
-        if (in->eof() && in->gcount() == 0)
+        if (!used_[id])
         {
-            return subtitle.images.size() > start;
+            used_[id] = true;
+            ids_.push_back(id);
         }
-        presentation = readu32(in);
-        decoding = readu32(in);
-        type = readu8(in);
-        length = readu16(in);
-        if (in->fail() || id[0] != 'P' || id[1] != 'G')
+        return slots_[id];
+    }
+
+    const std::vector<u8>& ids() const
+    {
+        return ids_;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < ids_.size(); i++)
         {
-            std::cerr << "bad segment" << std::endl;
-            return false;
+            used_[ids_[i]] = false;
         }
-#ifdef DEBUG_OUTPUT
-        std::cerr << "\tpts: " << presentation << " dts: " << decoding << std::endl;
-#endif
-        switch (type)
-        {
-        case SEGMENT_TYPE_PALETTE:
+        ids_.clear();
+    }
+
+    void swap(IdTable& other)
+    {
+        slots_.swap(other.slots_);
+        ids_.swap(other.ids_);
+        std::swap(used_, other.used_);
+    }
+
+private:
+    std::vector<T> slots_;
+    std::vector<u8> ids_;
+    bool used_[256];
+};
+
+/* Values by u16 id, searched linearly as an epoch has few objects. Slots
+ * are kept on clear() and reused, reset_slot() drops what a value holds
+ * on to without freeing its memory. */
+template<typename T>
+class ObjectTable
+{
+public:
+    ObjectTable()
+        : used_(0)
+    {
+    }
+
+    T* find(u16 id)
+    {
+        for (size_t i = 0; i < used_; i++)
         {
-            Palette palette;
-            if (!read_palette(in, palette, length))
-            {
-                std::cerr << "bad palette" << std::endl;
-                return false;
-            }
-#ifdef DEBUG_OUTPUT
-            std::cerr << "palette: " << palette << std::endl;
-#endif
-            palette_map::iterator i = current.palettes.find(palette.id);
-            if (i == current.palettes.end())
+            if (slots_[i].id == id)
             {
-                i = current.palettes.insert(std::make_pair(palette.id,
-                                                           palette_list())).first;
+                return &slots_[i].value;
             }
-            i->second.push_back(palette);
-            break;
         }
-        case SEGMENT_TYPE_IMAGE:
+        return NULL;
+    }
+
+    T& operator[](u16 id)
+    {
+        T* found = find(id);
+        if (found != NULL)
         {
-            Image image;
-            if (!read_image(in, image, length))
-            {
-                std::cerr << "bad image" << std::endl;
-                return false;
-            }
-#ifdef DEBUG_OUTPUT
-            std::cerr << "image: " << image << std::endl;
-#endif
-            image_map::iterator i = current.images.find(image.id);
-            if (i == current.images.end())
-            {
-                i = current.images.insert(std::make_pair(image.id, image_list())).first;
-            }
-            i->second.push_back(image);
-            break;
+            return *found;
         }
-        case SEGMENT_TYPE_TIMECODES:
+        if (used_ == slots_.size())
         {
-            Timecode timecode;
-            if (!read_timecode(in, timecode, length))
-            {
-                std::cerr << "bad timecode" << std::endl;
-                return false;
-            }
-            timecode.presentation = presentation;
-            timecode.decoding = decoding;
-#ifdef DEBUG_OUTPUT
-            std::cerr << "timecode: " << timecode << std::endl;
-#endif
-            current.timecodes.push_back(timecode);
-            break;
+            slots_.push_back(Slot());
         }
-        case SEGMENT_TYPE_WINDOW:
+        Slot& slot = slots_[used_++];
+        slot.id = id;
+        return slot.value;
+    }
+
+    size_t size() const
+    {
+        return used_;
+    }
+
+    u16 id(size_t i) const
+    {
+        return slots_[i].id;
+    }
+
+    T& at(size_t i)
+    {
+        return slots_[i].value;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < used_; i++)
         {
-            u16 pos;
-            u8 count;
-            if (length < 1)
-            {
-                std::cerr << "bad window (1)" << std::endl;
-                return false;
-            }
-            count = readu8(in);
-            pos = 1;
-            while (count-- > 0)
-            {
-                Window window;
-                long ret = read_window(in, window, length - pos);
-                if (ret < 0)
-                {
-                    std::cerr << "bad window (2)" << std::endl;
-                    return false;
-                }
+            reset_slot(slots_[i].value);
+        }
+        used_ = 0;
+    }
+
+    void swap(ObjectTable& other)
+    {
+        slots_.swap(other.slots_);
+        std::swap(used_, other.used_);
+    }
+
+private:
+    class Slot
+    {
+    public:
+        u16 id;
+        T value;
+    };
+
+    std::vector<Slot> slots_;
+    size_t used_;
+};
+
+typedef IdTable<Palette> palette_table;
+
+typedef std::vector<Image> image_list;
+typedef ObjectTable<image_list> image_table;
+
+static inline void reset_slot(image_list& imgs)
+{
+    imgs.clear();
+}
+
+typedef IdTable<Window> window_table;
+
+/* One object decoded to palette indices at its own size. The bounding box
+ * of every index value is kept so the visible area under any palette is
+ * the union of the boxes of its non-transparent entries. */
+class DecodedObject
+{
+public:
+    u16 width, height;
+    std::vector<u8> index;
+    /* x1 and y1 are exclusive, x1 == 0 if the index is not used */
+    u16 x0[256], y0[256], x1[256], y1[256];
+};
+
+class CachedObject
+{
+public:
+    CachedObject()
+        : valid(false)
+    {
+    }
+
+    bool valid;
+    u8 version;
+    DecodedObject obj;
+};
+
+static inline void reset_slot(CachedObject& cached)
+{
+    cached.valid = false;
+}
+
+/* decoded objects by id, valid while the image version is unchanged */
+typedef ObjectTable<CachedObject> object_cache;
+
+/* The segments of one display set, or for last everything defined so far
+ * in the epoch together with the composition currently shown */
+struct entry
+{
+    entry()
+        : timecode_count(0)
+    {
+    }
+
+    palette_table palettes;
+    image_table images;
+    window_table windows;
+    /* a display set has exactly one, counted to catch more */
+    Timecode timecode;
+    unsigned int timecode_count;
+    object_cache decoded;
+};
+
+struct decode_options
+{
+    decode_options()
+        : indexed(false), crop(true), matrix(COLOR_MATRIX_AUTO)
+    {
+    }
+
+    /* render palette indices instead of RGBA */
+    bool indexed;
+    /* cut images down to their non-transparent pixels instead of the
+     * whole window */
+    bool crop;
+    color_matrix_t matrix;
+};
+
+static bool create_subimage(Subtitle& subtitle, entry& last, entry& current,
+                            const decode_options& options);
+
+/* Returns false if the segment is malformed. Completed display sets are
+ * appended to subtitle.images. */
+static bool read_segment(const Segment& segment, Subtitle& subtitle,
+                         entry& last, entry& current,
+                         const decode_options& options)
+{
+    const u8* in = segment.data;
+    u16 length = segment.length;
 #ifdef DEBUG_OUTPUT
-                std::cerr << "window: " << window << std::endl;
+    std::cerr << "\tpts: " << segment.presentation << " dts: " << segment.decoding << std::endl;
 #endif
-                current.windows.push_back(window);
-                pos += ret;
-            }
-            if (pos < length)
-            {
-                std::cerr << "bad window (3)" << std::endl;
-                return false;
-            }
-            break;
+    switch (segment.type)
+    {
+    case SEGMENT_TYPE_PALETTE:
+    {
+        if (length < 1)
+        {
+            std::cerr << "bad palette" << std::endl;
+            return false;
         }
-        case SEGMENT_TYPE_END:
-            if (length != 0)
+        Palette& palette = current.palettes[in[0]];
+        if (!read_palette(in, palette, length))
+        {
+            std::cerr << "bad palette" << std::endl;
+            return false;
+        }
+#ifdef DEBUG_OUTPUT
+        std::cerr << "palette: " << palette << std::endl;
+#endif
+        break;
+    }
+    case SEGMENT_TYPE_IMAGE:
+    {
+        Image image;
+        if (!read_image(in, image, length))
+        {
+            std::cerr << "bad image" << std::endl;
+            return false;
+        }
+        image.data = segment.owner;
+        if (image.data != NULL)
+        {
+            image.data->retain();
+        }
+#ifdef DEBUG_OUTPUT
+        std::cerr << "image: " << image << std::endl;
+#endif
+        image_list& imgs = current.images[image.id];
+        if ((image.flags & IMAGE_FLAG_FIRST) != 0)
+        {
+            imgs.clear();
+        }
+        imgs.push_back(image);
+        break;
+    }
+    case SEGMENT_TYPE_TIMECODES:
+    {
+        /* a second one is read over the first, create_subimage() drops
+         * the display set anyway */
+        Timecode& timecode = current.timecode;
+        current.timecode_count++;
+        if (!read_timecode(in, timecode, length))
+        {
+            std::cerr << "bad timecode" << std::endl;
+            return false;
+        }
+        timecode.presentation = segment.presentation;
+        timecode.decoding = segment.decoding;
+#ifdef DEBUG_OUTPUT
+        std::cerr << "timecode: " << timecode << std::endl;
+#endif
+        break;
+    }
+    case SEGMENT_TYPE_WINDOW:
+    {
+        u16 pos;
+        u8 count;
+        if (length < 1)
+        {
+            std::cerr << "bad window (1)" << std::endl;
+            return false;
+        }
+        count = in[0];
+        pos = 1;
+        while (count-- > 0)
+        {
+            Window window;
+            long ret = read_window(in + pos, window, length - pos);
+            if (ret < 0)
             {
+                std::cerr << "bad window (2)" << std::endl;
                 return false;
             }
 #ifdef DEBUG_OUTPUT
-            std::cerr << "end" << std::endl << std::endl;
+            std::cerr << "window: " << window << std::endl;
 #endif
-            create_subimage(subtitle, last, current);
-            break;
-        default:
-            std::cerr << "unknown: " << type << std::endl;
-            in->ignore(length);
-            break;
+            current.windows[window.id] = window;
+            pos += ret;
+        }
+        if (pos < length)
+        {
+            std::cerr << "bad window (3)" << std::endl;
+            return false;
+        }
+        break;
+    }
+    case SEGMENT_TYPE_END:
+        if (length != 0)
+        {
+            return false;
         }
+#ifdef DEBUG_OUTPUT
+        std::cerr << "end" << std::endl << std::endl;
+#endif
+        create_subimage(subtitle, last, current, options);
+        break;
+    default:
+        std::cerr << "unknown: " << (int)segment.type << std::endl;
+        break;
     }
+    return true;
 }
 
 static void reset_entry(entry& entry)
 {
-    entry.timecodes.clear();
+    entry.timecode_count = 0;
     entry.windows.clear();
     entry.palettes.clear();
     entry.images.clear();
+    entry.decoded.clear();
 }
 
-static void transfer_entry(entry& dst, entry& src)
+/* Updates the epoch state in dst with the display set in src. Palettes and
+ * images already known in the same version are kept so their converted and
+ * decoded forms stay valid. */
+static void merge_entry(entry& dst, entry& src)
 {
-    reset_entry(dst);
-    for (timecode_list::iterator i(src.timecodes.begin()); i != src.timecodes.end(); ++i)
+    std::swap(dst.timecode, src.timecode);
+    dst.timecode_count = src.timecode_count;
+    const std::vector<u8>& windows = src.windows.ids();
+    for (size_t i = 0; i < windows.size(); i++)
     {
-        dst.timecodes.push_back(*i);
+        dst.windows[windows[i]] = *src.windows.find(windows[i]);
     }
-    for (window_list::iterator i(src.windows.begin()); i != src.windows.end(); ++i)
+    const std::vector<u8>& palettes = src.palettes.ids();
+    for (size_t i = 0; i < palettes.size(); i++)
     {
-        dst.windows.push_back(*i);
+        const Palette& pal = *src.palettes.find(palettes[i]);
+        Palette* known = dst.palettes.find(palettes[i]);
+        if (known == NULL || known->version != pal.version)
+        {
+            dst.palettes[palettes[i]] = pal;
+        }
+    }
+    for (size_t i = 0; i < src.images.size(); i++)
+    {
+        dst.images[src.images.id(i)].swap(src.images.at(i));
     }
-    for (palette_map::iterator i(src.palettes.begin()); i != src.palettes.end(); ++i)
+    reset_entry(src);
+}
+
+/* Starts a new epoch in dst with the display set in src. Nothing of the
+ * old epoch survives, so the tables trade places instead of being copied
+ * and src gets the old ones to reuse. */
+static void start_epoch(entry& dst, entry& src)
+{
+    std::swap(dst.timecode, src.timecode);
+    dst.timecode_count = src.timecode_count;
+    dst.palettes.swap(src.palettes);
+    dst.images.swap(src.images);
+    dst.windows.swap(src.windows);
+    dst.decoded.clear();
+    reset_entry(src);
+}
+
+class Rect
+{
+public:
+    Rect()
+        : x0(0), y0(0), x1(0), y1(0)
     {
-        dst.palettes.insert(*i);
     }
-    for (image_map::iterator i(src.images.begin()); i != src.images.end(); ++i)
+
+    Rect(s32 x0, s32 y0, s32 x1, s32 y1)
+        : x0(x0), y0(y0), x1(x1), y1(y1)
     {
-        dst.images.insert(*i);
     }
-    reset_entry(src);
+
+    bool empty() const
+    {
+        return x1 <= x0 || y1 <= y0;
+    }
+
+    Rect intersect(const Rect& r) const
+    {
+        return Rect(std::max(x0, r.x0), std::max(y0, r.y0),
+                    std::min(x1, r.x1), std::min(y1, r.y1));
+    }
+
+    Rect unite(const Rect& r) const
+    {
+        if (empty())
+        {
+            return r;
+        }
+        if (r.empty())
+        {
+            return *this;
+        }
+        return Rect(std::min(x0, r.x0), std::min(y0, r.y0),
+                    std::max(x1, r.x1), std::max(y1, r.y1));
+    }
+
+    s32 x0, y0, x1, y1;
+};
+
+/* Grows the bounding box of color to include x0 ... x1 - 1 on row y */
+static inline void mark(DecodedObject& obj, u8 color, u32 x0, u32 x1, u32 y)
+{
+    if (obj.x1[color] == 0)
+    {
+        obj.x0[color] = x0;
+        obj.y0[color] = y;
+        obj.x1[color] = x1;
+    }
+    else
+    {
+        if (x0 < obj.x0[color])
+        {
+            obj.x0[color] = x0;
+        }
+        if (x1 > obj.x1[color])
+        {
+            obj.x1[color] = x1;
+        }
+    }
+    obj.y1[color] = y + 1;
 }
 
-static inline void ycrcb2rgb_iturbt601(u8 y, u8 cr, u8 cb, u8 &r, u8 &g, u8 &b)
+/* Decodes the RLE data of one object in a single pass over its bytes.
+ * Runs are filled with memset and stretches of literal pixels are copied
+ * as they are. Anything outside the object size is dropped, so malformed
+ * data can never write out of bounds. */
+static bool decode_object(const image_list& imgs, DecodedObject& obj)
 {
-    /* Kb = 0.114, Kr = 0.299 */
-    const float _y = 298.082 * y;
-    r = (u16)(_y                + 408.583 * cr - 57067.776) >> 8;
-    g = (u16)(_y - 100.291 * cb - 208.120 * cr + 34707.456) >> 8;
-    b = (u16)(_y + 516.412 * cb                - 70870.016) >> 8;
+    obj.width = imgs.front().width;
+    obj.height = imgs.front().height;
+    obj.index.assign((size_t)obj.width * obj.height, 0);
+    std::memset(obj.x1, 0, sizeof(obj.x1));
+    stat_add(STAT_PIXELS_DECODED, obj.index.size());
+
+    /* objects larger than one segment are joined first */
+    static thread_local std::vector<u8> joined;
+    const u8* p = imgs.front().ptr;
+    const u8* end = p + imgs.front().size;
+    if (imgs.size() > 1)
+    {
+        joined.clear();
+        for (image_list::const_iterator img(imgs.begin()); img != imgs.end(); ++img)
+        {
+            joined.insert(joined.end(), img->ptr, img->ptr + img->size);
+        }
+        p = joined.empty() ? NULL : &joined[0];
+        end = p + joined.size();
+    }
+
+    const u32 width = obj.width, height = obj.height;
+    u8* pixels = obj.index.empty() ? NULL : &obj.index[0];
+    u32 x = 0, y = 0;
+    while (p < end)
+    {
+        if (*p != 0)
+        {
+            /* stretch of single pixels */
+            const u8* literal = p;
+            do
+            {
+                p++;
+            } while (p < end && *p != 0);
+            u32 size = p - literal;
+            if (y < height && x < width)
+            {
+                u32 n = std::min(size, width - x);
+                std::memcpy(pixels + y * width + x, literal, n);
+                for (u32 i = 0; i < n; i++)
+                {
+                    mark(obj, literal[i], x + i, x + i + 1, y);
+                }
+            }
+            x += size;
+            continue;
+        }
+        if (end - p < 2)
+        {
+            break;
+        }
+        u8 code = p[1];
+        u32 size;
+        u8 color = 0;
+        switch (code & 0xc0)
+        {
+        case 0x00:
+            if (code == 0)
+            {
+                /* 00 00 -> new line */
+                x = 0;
+                y++;
+                p += 2;
+                continue;
+            }
+            /* 00 0x -> x zeroes */
+            size = code;
+            p += 2;
+            break;
+        case 0x40:
+            /* 00 4x yy -> xyy zeroes */
+            if (end - p < 3)
+            {
+                p = end;
+                continue;
+            }
+            size = ((code & 0x3f) << 8) | p[2];
+            p += 3;
+            break;
+        case 0x80:
+            /* 00 8x yy -> x times value yy */
+            if (end - p < 3)
+            {
+                p = end;
+                continue;
+            }
+            size = code & 0x3f;
+            color = p[2];
+            p += 3;
+            break;
+        default:
+            /* 00 cx yy zz -> xyy times value zz */
+            if (end - p < 4)
+            {
+                p = end;
+                continue;
+            }
+            size = ((code & 0x3f) << 8) | p[2];
+            color = p[3];
+            p += 4;
+            break;
+        }
+        if (y < height && x < width && size > 0)
+        {
+            u32 n = std::min(size, width - x);
+            std::memset(pixels + y * width + x, color, n);
+            mark(obj, color, x, x + n, y);
+        }
+        x += size;
+    }
+    if (p != end)
+    {
+        std::cerr << "truncated rle data" << std::endl;
+    }
+    return true;
 }
 
-static inline void ycrcb2rgb_iturbt709(u8 y, u8 cr, u8 cb, u8 &r, u8 &g, u8 &b)
+/* RGBA version of pal, converted once per palette version and matrix */
+static const u32* convert_palette(Palette& pal, color_matrix_t matrix)
 {
-    /* Kb = 0.0722, Kr = 0.2126 */
-    const float _y = 298.082 * y;
-    r = (u16)(_y                + 458.942 * cr - 63513.600) >> 8;
-    g = (u16)(_y -  54.592 * cb - 136.425 * cr + 19680.768) >> 8;
-    b = (u16)(_y + 540.775 * cb                - 73988.352) >> 8;
+    if (pal.matrix != matrix)
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            const u32 entry = pal.entries[i];
+            if ((pal.defined[i >> 6] & ((u64)1 << (i & 63))) == 0)
+            {
+                pal.rgba[i] = 0;
+                continue;
+            }
+            pal.rgba[i] = ycbcr_to_rgb(entry >> 24, entry >> 8, entry >> 16,
+                                       matrix) | (entry & 0xff);
+        }
+        pal.matrix = matrix;
+    }
+    return pal.rgba;
 }
 
-static bool render(SubImage& subimg, palette_list palettes, image_map images)
+/* Copies area (object coordinates) of obj to x, y in subimg */
+static void copy_area(const DecodedObject& obj, const Rect& area,
+                      SubImage& subimg, u32 x, u32 y)
 {
-    if (images.size() != 1)
+    u32 width = area.x1 - area.x0;
+    for (s32 row = area.y0; row < area.y1; row++)
     {
-        std::cerr << "other than one image id per timecode is not supported" << std::endl;
-        return false;
+        const u8* src = &obj.index[row * obj.width + area.x0];
+        u32 offset = (y + row - area.y0) * subimg.width + x;
+        if (subimg.indexed())
+        {
+            std::memcpy(subimg.index + offset, src, width);
+        }
+        else
+        {
+            u32* dst = subimg.rgba + offset;
+            for (u32 i = 0; i < width; i++)
+            {
+                dst[i] = subimg.palette[src[i]];
+            }
+        }
     }
-    if (palettes.size() != 1)
+}
+
+/* Renders object as seen through wnd. Returns false on errors and, when
+ * cropping, if nothing of the object is visible. */
+static bool render(SubImage& subimg, const Object& object, const Window& wnd,
+                   Palette& pal, image_table& images, object_cache& decoded,
+                   color_matrix_t matrix, const decode_options& options)
+{
+    const image_list* found = images.find(object.id);
+    if (found == NULL || found->empty())
     {
-        std::cerr << "other than one palette per timecode is not supported" << std::endl;
+        std::cerr << "missing image " << object.id << std::endl;
         return false;
     }
-    std::memset(subimg.rgba, 0, subimg.width * subimg.height * sizeof(u32));
-    image_list imgs = images[0];
-    Image first = imgs.front();
-    Image last = imgs.back();
+    const image_list& imgs = *found;
+    const Image& first = imgs.front();
+    const Image& last = imgs.back();
     if ((first.flags & IMAGE_FLAG_FIRST) == 0 ||
         (last.flags & IMAGE_FLAG_LAST) == 0)
     {
         std::cerr << "invalid image sequence" << std::endl;
         return false;
     }
-    u8 extended = 0;
-    u8 arg1 = 0, arg2 = 0;
-    u32* row = subimg.rgba;
-    u32* pixel = row;
-    u32 palette[256];
-    u16 size;
-    for (Palette::entry_list::iterator entry(palettes.front().entries.begin());
-         entry != palettes.front().entries.end(); entry++)
-    {
-        u8 r, g, b;
-#if 0
-        ycrcb2rgb_iturbt601(entry->y, entry->cr, entry->cb, r, g, b);
-#else
-        ycrcb2rgb_iturbt709(entry->y, entry->cr, entry->cb, r, g, b);
-#endif
-        palette[entry->index] = (r << 24) | (g << 16) | (b << 8) | entry->alpha;
+    CachedObject& cached = decoded[object.id];
+    if (!cached.valid || cached.version != first.version)
+    {
+        stat_add(STAT_OBJECT_CACHE_MISSES);
+        cached.valid = decode_object(imgs, cached.obj);
+        if (!cached.valid)
+        {
+            return false;
+        }
+        cached.version = first.version;
+    }
+    else
+    {
+        stat_add(STAT_OBJECT_CACHE_HITS);
+    }
+    const DecodedObject& obj = cached.obj;
+    const u32* palette = convert_palette(pal, matrix);
+
+    SubImage::format_t format = options.indexed ? SubImage::INDEXED : SubImage::RGBA;
+    /* where the object's top left corner would be on screen */
+    s32 origin_x = object.x, origin_y = object.y;
+    Rect shown(0, 0, obj.width, obj.height);
+    if ((object.flags & OBJ_FLAG_CROPPED) != 0)
+    {
+        origin_x -= object.crop_x;
+        origin_y -= object.crop_y;
+        shown = shown.intersect(Rect(object.crop_x, object.crop_y,
+                                     object.crop_x + object.crop_width,
+                                     object.crop_y + object.crop_height));
+    }
+    /* the part of the object inside the window, in object coordinates */
+    Rect visible = shown.intersect(
+        Rect(wnd.x - origin_x, wnd.y - origin_y,
+             wnd.x + wnd.width - origin_x, wnd.y + wnd.height - origin_y));
+    if (options.crop)
+    {
+        Rect content;
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            if ((palette[i] & 0xff) != 0 && obj.x1[i] != 0)
+            {
+                content = content.unite(Rect(obj.x0[i], obj.y0[i],
+                                             obj.x1[i], obj.y1[i]));
+            }
+        }
+        Rect area = content.intersect(visible);
+        if (area.empty())
+        {
+            return false;
+        }
+        subimg = SubImage(area.x1 - area.x0, area.y1 - area.y0, format);
+        subimg.x = origin_x + area.x0;
+        subimg.y = origin_y + area.y0;
+        std::memcpy(subimg.palette, palette, sizeof(subimg.palette));
+        copy_area(obj, area, subimg, 0, 0);
+        return true;
+    }
+
+    subimg = SubImage(wnd.width, wnd.height, format);
+    subimg.x = wnd.x;
+    subimg.y = wnd.y;
+    std::memcpy(subimg.palette, palette, sizeof(subimg.palette));
+    if (subimg.indexed())
+    {
+        /* background is the first transparent entry, unused ones are 0 */
+        u8 background = 0;
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            if ((palette[i] & 0xff) == 0)
+            {
+                background = i;
+                break;
+            }
+        }
+        std::memset(subimg.index, background, subimg.width * subimg.height);
+    }
+    else
+    {
+        std::memset(subimg.rgba, 0, subimg.width * subimg.height * sizeof(u32));
+    }
+    if (!visible.empty())
+    {
+        copy_area(obj, visible, subimg, origin_x + visible.x0 - wnd.x,
+                  origin_y + visible.y0 - wnd.y);
+    }
+    return true;
+}
+/* Emits the composition shown in the epoch last, ending at end */
+static void show_composition(Subtitle& subtitle, entry& last, u32 end,
+                             const decode_options& options)
+{
+    const Timecode& last_tc = last.timecode;
+    if (last_tc.objects.empty())
+    {
+        return;
+    }
+
+    if (subtitle.width == 0)
+    {
+        subtitle.width = last_tc.width;
+        subtitle.height = last_tc.height;
+    }
+    if (subtitle.fps == 0 && last_tc.fps != TIMECODE_FPS_UNKNOWN)
+    {
+        switch (last_tc.fps)
+        {
+        case TIMECODE_FPS_24:
+            subtitle.fps = 24;
+            break;
+        case TIMECODE_FPS_UNKNOWN:
+            break;
+        }
+    }
+
+    Palette* pal = last.palettes.find(last_tc.palette_id);
+    if (pal == NULL)
+    {
+        std::cerr << "missing palette " << (int)last_tc.palette_id << std::endl;
+        return;
+    }
+
+    color_matrix_t matrix = options.matrix;
+    if (matrix == COLOR_MATRIX_AUTO)
+    {
+        matrix = color_matrix_for(last_tc.width, last_tc.height);
+    }
+
+    /* 90kHz */
+    u64 start_s = last_tc.presentation / 90000;
+    u64 start_ns = (last_tc.presentation % 90000) * 11111;
+    u64 duration_s = end / 90000;
+    u64 duration_ns = (end % 90000) * 11111;
+    duration_s -= start_s;
+    if (duration_ns < start_ns)
+    {
+        duration_s -= 1;
+        duration_ns += 1000000000ul;
+    }
+    duration_ns -= start_ns;
+
+    for (Timecode::object_list::const_iterator i(last_tc.objects.begin());
+         i != last_tc.objects.end(); ++i)
+    {
+        const Window* wnd = last.windows.find(i->window_id);
+        if (wnd == NULL)
+        {
+            std::cerr << "missing window " << (int)i->window_id << std::endl;
+            continue;
+        }
+        SubImage subimg;
+        if (!render(subimg, *i, *wnd, *pal, last.images, last.decoded,
+                    matrix, options))
+        {
+            continue;
+        }
+        subimg.forced = (i->flags & OBJ_FLAG_FORCED_ON);
+        subimg.start_s = start_s;
+        subimg.start_ns = start_ns;
+        subimg.duration_s = duration_s;
+        subimg.duration_ns = duration_ns;
+
+        stat_add(STAT_IMAGES);
+        subtitle.images.push_back(std::move(subimg));
+    }
+}
+
+bool create_subimage(Subtitle& subtitle, entry& last, entry& current,
+                     const decode_options& options)
+{
+    if (current.timecode_count == 0)
+    {
+        std::cerr << "entry without timecodes" << std::endl;
+        reset_entry(last);
+        reset_entry(current);
+        return false;
+    }
+    if (current.timecode_count > 1)
+    {
+        std::cerr << "multiple timecodes before end?" << std::endl;
+        reset_entry(last);
+        reset_entry(current);
+        return false;
+    }
+    const Timecode& current_tc = current.timecode;
+    bool epoch_start = (current_tc.comp_state & TIMECODE_COMP_STATE_EPOCH_START) != 0;
+    if (last.timecode_count == 0)
+    {
+        if (!epoch_start)
+        {
+            std::cerr << "display set outside of an epoch" << std::endl;
+            reset_entry(current);
+            return false;
+        }
+    }
+    else
+    {
+        /* whatever was shown ends with the new display set */
+        show_composition(subtitle, last, current_tc.presentation, options);
+    }
+    if (epoch_start)
+    {
+        start_epoch(last, current);
+    }
+    else
+    {
+        merge_entry(last, current);
+    }
+    return true;
+}
+
+bool read_palette(const u8* in, Palette& palette, u16 length)
+{
+    if (length < 2)
+    {
+        return false;
+    }
+    palette.id = in[0];
+    palette.version = in[1];
+    palette.matrix = COLOR_MATRIX_AUTO;
+    std::memset(palette.defined, 0, sizeof(palette.defined));
+    in += 2;
+    length -= 2;
+    if ((length % 5) != 0)
+    {
+        return false;
+    }
+    while (length > 0)
+    {
+        const u8 index = in[0];
+        palette.entries[index] = load_be32(in + 1);
+        palette.defined[index >> 6] |= (u64)1 << (index & 63);
+        in += 5;
+        length -= 5;
+    }
+    return true;
+}
+
+bool read_image(const u8* in, Image& image, u16 length)
+{
+    if (length < 4)
+    {
+        return false;
+    }
+    image.id = load_be16(in);
+    image.version = in[2];
+    image.flags = in[3];
+    in += 4;
+    length -= 4;
+    if ((image.flags & IMAGE_FLAG_FIRST) == IMAGE_FLAG_FIRST)
+    {
+        if (length < 7)
+        {
+            return false;
+        }
+        image.total = load_be24(in);
+        image.width = load_be16(in + 3);
+        image.height = load_be16(in + 5);
+        in += 7;
+        length -= 7;
+    }
+    image.size = length;
+    image.ptr = in;
+    return true;
+}
+
+long read_window(const u8* in, Window& window, u16 length)
+{
+    if (length < 9)
+    {
+        return -1;
+    }
+    window.id = in[0];
+    window.x = load_be16(in + 1);
+    window.y = load_be16(in + 3);
+    window.width = load_be16(in + 5);
+    window.height = load_be16(in + 7);
+    return 9;
+}
+
+bool read_timecode(const u8* in, Timecode& timecode, u16 length)
+{
+    u8 count;
+    u16 pos;
+    if (length < 11)
+    {
+        return false;
+    }
+    timecode.width = load_be16(in);
+    timecode.height = load_be16(in + 2);
+    switch (in[4])
+    {
+    case TIMECODE_FPS_24:
+        timecode.fps = TIMECODE_FPS_24;
+        break;
+    default:
+        timecode.fps = TIMECODE_FPS_UNKNOWN;
+        break;
+    }
+    timecode.comp_num = load_be16(in + 5);
+    timecode.comp_state = in[7];
+    timecode.palette_flags = in[8];
+    timecode.palette_id = in[9];
+    count = in[10];
+    pos = 11;
+    timecode.objects.clear();
+    while (count-- > 0)
+    {
+        Object object;
+        long ret = read_object(in + pos, object, length - pos);
+        if (ret < 0)
+        {
+            return false;
+        }
+        pos += ret;
+        timecode.objects.push_back(object);
+    }
+    return pos == length;
+}
+
+long read_object(const u8* in, Object& object, u16 length)
+{
+    if (length < 8)
+    {
+        return -1;
+    }
+    object.id = load_be16(in);
+    object.window_id = in[2];
+    object.flags = in[3];
+    object.x = load_be16(in + 4);
+    object.y = load_be16(in + 6);
+    if ((object.flags & OBJ_FLAG_CROPPED) == 0)
+    {
+        return 8;
+    }
+    if (length < 16)
+    {
+        return -1;
+    }
+    object.crop_x = load_be16(in + 8);
+    object.crop_y = load_be16(in + 10);
+    object.crop_width = load_be16(in + 12);
+    object.crop_height = load_be16(in + 14);
+    return 16;
+}
+
+/* Maps path into file if possible, otherwise reads it through a new
+ * stream that the caller deletes after the reader. "-" reads from stdin.
+ * Returns NULL if path cannot be opened. */
+static SegmentReader* open_segment_reader(const char* path, MappedFile& file,
+                                          std::ifstream*& stream)
+{
+    if (std::strcmp(path, "-") == 0)
+    {
+        return new StreamSegmentReader(&std::cin);
+    }
+    if (file.open(path))
+    {
+        return new MappedSegmentReader(file.data(), file.size());
+    }
+    stream = new std::ifstream(path, std::ios_base::in | std::ios_base::binary);
+    if (!stream->is_open())
+    {
+        return NULL;
+    }
+    return new StreamSegmentReader(stream);
+}
+
+class SupReader::Impl
+{
+public:
+    Impl()
+        : reader(NULL), stream(NULL), start(0), end(~(u64)0), fresh(true), bad(false)
+    {
+    }
+
+    ~Impl()
+    {
+        delete reader;
+        delete stream;
+    }
+
+    SegmentReader* reader;
+    MappedFile file;
+    std::ifstream* stream;
+    Subtitle subtitle;
+    entry last, current;
+    decode_options options;
+    /* images outside [start, end) in nanoseconds are dropped */
+    u64 start, end;
+    /* nothing decoded yet */
+    bool fresh;
+    bool bad;
+};
+
+SupReader::SupReader()
+    : impl_(new Impl())
+{
+}
+
+SupReader::~SupReader()
+{
+    delete impl_;
+}
+
+void SupReader::reset()
+{
+    Impl* impl = new Impl();
+    impl->options = impl_->options;
+    delete impl_;
+    impl_ = impl;
+}
+
+bool SupReader::open(std::istream* in)
+{
+    reset();
+    impl_->reader = new StreamSegmentReader(in);
+    return true;
+}
+
+bool SupReader::open(const char* path)
+{
+    if (std::strcmp(path, "-") == 0)
+    {
+        return open(&std::cin);
+    }
+    reset();
+    impl_->reader = open_segment_reader(path, impl_->file, impl_->stream);
+    return impl_->reader != NULL;
+}
+
+void SupReader::set_indexed(bool indexed)
+{
+    impl_->options.indexed = indexed;
+}
+
+void SupReader::set_crop(bool crop)
+{
+    impl_->options.crop = crop;
+}
+
+void SupReader::set_color_matrix(color_matrix_t matrix)
+{
+    impl_->options.matrix = matrix;
+}
+
+/* SubImage times count 11111ns per 90kHz tick */
+static inline u64 ticks_to_ns(u64 ticks)
+{
+    return ticks / 90000 * 1000000000ull + ticks % 90000 * 11111;
+}
+
+static inline u64 start_ns(const SubImage& image)
+{
+    return image.start_s * 1000000000ull + image.start_ns;
+}
+
+static inline u64 end_ns(const SubImage& image)
+{
+    return start_ns(image) + image.duration_s * 1000000000ull + image.duration_ns;
+}
+
+bool SupReader::set_range(u64 start, u64 end, const SupIndex* index)
+{
+    impl_->start = start;
+    impl_->end = end;
+    if (index == NULL || impl_->reader == NULL || index->epochs.empty())
+    {
+        return true;
+    }
+    /* u32 PTS wrap after 13 hours, later starts go to the last epoch */
+    const u64 ticks = std::min<u64>(start / 1000000000ull * 90000 +
+                                    start % 1000000000ull / 11111, 0xffffffff);
+    const SupIndex::Epoch* epoch = index->find(ticks);
+    if (ticks_to_ns(epoch->presentation) > start || epoch->offset == 0)
+    {
+        return true;
+    }
+    return impl_->reader->seek(epoch->offset);
+}
+
+bool SupReader::next(SubImage& image)
+{
+    Subtitle& subtitle = impl_->subtitle;
+    if (impl_->reader == NULL)
+    {
+        return false;
+    }
+    impl_->fresh = false;
+    for (;;)
+    {
+        StatTimer timer(STAT_TIME_DECODE);
+        while (subtitle.images.empty())
+        {
+            Segment segment;
+            if (!impl_->reader->next(segment))
+            {
+                return false;
+            }
+            if (!read_segment(segment, subtitle, impl_->last, impl_->current,
+                              impl_->options))
+            {
+                impl_->bad = true;
+                return false;
+            }
+        }
+        image = std::move(subtitle.images.front());
+        subtitle.images.pop_front();
+        const u64 start = start_ns(image);
+        if (start < impl_->end && end_ns(image) > impl_->start)
+        {
+            return true;
+        }
+        if (start >= impl_->end)
+        {
+            /* images come in presentation order, nothing later fits */
+            subtitle.images.clear();
+            return false;
+        }
+    }
+}
+
+/* Decodes the epochs starting from begin up to end (byte offsets). The
+ * display set at end is read too, it ends the last composition. */
+static bool decode_epochs(const MappedFile& file, u64 begin, u64 end,
+                          const decode_options& options, Subtitle& subtitle)
+{
+    StatTimer timer(STAT_TIME_DECODE);
+    MappedSegmentReader reader(file.data(), file.size());
+    reader.seek(begin);
+    entry last, current;
+    Segment segment;
+    u64 pos = begin;
+    while (reader.next(segment))
+    {
+        if (!read_segment(segment, subtitle, last, current, options))
+        {
+            return false;
+        }
+        if (pos >= end && segment.type == SEGMENT_TYPE_END)
+        {
+            break;
+        }
+        pos += SEGMENT_HEADER_SIZE + segment.length;
+    }
+    return !reader.bad();
+}
+
+/* One run of consecutive epochs for a worker */
+class EpochRange
+{
+public:
+    EpochRange(u64 begin, u64 end)
+        : begin(begin), end(end), ok(false)
+    {
+    }
+
+    u64 begin, end;
+    Subtitle subtitle;
+    bool ok;
+};
+
+static void decode_worker(const MappedFile* file, const decode_options* options,
+                          std::vector<EpochRange>* ranges,
+                          std::atomic<size_t>* next)
+{
+    for (size_t i = (*next)++; i < ranges->size(); i = (*next)++)
+    {
+        EpochRange& range = (*ranges)[i];
+        range.ok = decode_epochs(*file, range.begin, range.end, *options,
+                                 range.subtitle);
+    }
+}
+
+bool SupReader::read_all(Subtitle& subtitle, unsigned int jobs)
+{
+    SupIndex index;
+    if (jobs < 2 || !impl_->fresh || !impl_->file.is_open() ||
+        !index.build(impl_->file.data(), impl_->file.size()) ||
+        index.epochs.size() < 2)
+    {
+        SubImage image;
+        while (next(image))
+        {
+            subtitle.images.push_back(std::move(image));
+        }
+        subtitle.width = width();
+        subtitle.height = height();
+        subtitle.fps = fps();
+        return !bad();
+    }
+    impl_->fresh = false;
+
+    /* several ranges per worker so a slow one does not hold up the rest,
+     * ranges entirely outside the time range are left out */
+    const u64 size = impl_->file.size();
+    const u64 target = size / (jobs * 4) + 1;
+    std::vector<EpochRange> ranges;
+    size_t first = 0;
+    for (size_t i = 1; i <= index.epochs.size(); i++)
+    {
+        const u64 end = i < index.epochs.size() ? index.epochs[i].offset : size;
+        if (end - index.epochs[first].offset < target && i < index.epochs.size())
+        {
+            continue;
+        }
+        const u64 shown = first == 0 ? 0 : ticks_to_ns(index.epochs[first].presentation);
+        const u64 hidden = i < index.epochs.size() ?
+                           ticks_to_ns(index.epochs[i].presentation) : ~(u64)0;
+        if (shown > hidden || (hidden > impl_->start && shown < impl_->end))
+        {
+            ranges.push_back(EpochRange(first == 0 ? 0 : index.epochs[first].offset,
+                                        end));
+        }
+        first = i;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned int n = 0; n < jobs && n < ranges.size(); n++)
+    {
+        workers.push_back(std::thread(decode_worker, &impl_->file, &impl_->options,
+                                      &ranges, &next));
+    }
+    for (size_t n = 0; n < workers.size(); n++)
+    {
+        workers[n].join();
+    }
+
+    /* ranges are in file order, which is presentation order */
+    bool ok = true;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        Subtitle& part = ranges[i].subtitle;
+        ok = ok && ranges[i].ok;
+        if (impl_->subtitle.width == 0)
+        {
+            impl_->subtitle.width = part.width;
+            impl_->subtitle.height = part.height;
+        }
+        if (impl_->subtitle.fps == 0)
+        {
+            impl_->subtitle.fps = part.fps;
+        }
+        for (Subtitle::subimages_t::iterator j(part.images.begin());
+             j != part.images.end();)
+        {
+            if (start_ns(*j) < impl_->end && end_ns(*j) > impl_->start)
+            {
+                ++j;
+                continue;
+            }
+            j = part.images.erase(j);
+        }
+        subtitle.images.splice(subtitle.images.end(), part.images);
+    }
+    subtitle.width = width();
+    subtitle.height = height();
+    subtitle.fps = fps();
+    impl_->bad = !ok;
+    return ok;
+}
+
+bool SupReader::bad() const
+{
+    return impl_->bad || (impl_->reader != NULL && impl_->reader->bad());
+}
+
+u32 SupReader::width() const
+{
+    return impl_->subtitle.width;
+}
+
+u32 SupReader::height() const
+{
+    return impl_->subtitle.height;
+}
+
+u16 SupReader::fps() const
+{
+    return impl_->subtitle.fps;
+}
+
+/* Header scan behind SupIndex::build(), over data if it is in memory,
+ * otherwise seeking through stream */
+static bool scan_epochs(const u8* data, std::istream* stream, u64 size,
+                        std::vector<SupIndex::Epoch>& epochs)
+{
+    epochs.clear();
+    /* the header and the PCS up to its composition state */
+    u8 buffer[SEGMENT_HEADER_SIZE + 8];
+    u64 pos = 0;
+    while (pos < size)
+    {
+        const size_t want = std::min<u64>(sizeof(buffer), size - pos);
+        const u8* ptr;
+        if (data != NULL)
+        {
+            ptr = data + pos;
+        }
+        else
+        {
+            stream->seekg(pos);
+            stream->read(reinterpret_cast<char*>(buffer), want);
+            ptr = buffer;
+        }
+        Segment segment;
+        if (want < SEGMENT_HEADER_SIZE || (data == NULL && stream->fail()) ||
+            !SegmentReader::parse_header(ptr, segment) ||
+            size - pos - SEGMENT_HEADER_SIZE < segment.length)
+        {
+            std::cerr << "bad segment" << std::endl;
+            return false;
+        }
+        if (segment.type == SEGMENT_TYPE_TIMECODES && segment.length >= 8 &&
+            (ptr[SEGMENT_HEADER_SIZE + 7] & TIMECODE_COMP_STATE_EPOCH_START) != 0)
+        {
+            SupIndex::Epoch epoch;
+            epoch.offset = pos;
+            epoch.presentation = segment.presentation;
+            epochs.push_back(epoch);
+        }
+        pos += SEGMENT_HEADER_SIZE + segment.length;
+    }
+    return true;
+}
+
+bool SupIndex::build(const u8* data, u64 size)
+{
+    this->size = size;
+    return scan_epochs(data, NULL, size, epochs);
+}
+
+bool SupIndex::build(const char* path)
+{
+    MappedFile file;
+    if (file.open(path))
+    {
+        return build(file.data(), file.size());
+    }
+    std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+    if (!stream.is_open() || !stream.seekg(0, std::ios_base::end))
+    {
+        return false;
+    }
+    size = stream.tellg();
+    return scan_epochs(NULL, &stream, size, epochs);
+}
+
+/* Sidecar layout, little endian: magic, indexed file size, epoch count,
+ * then offset and PTS of every epoch */
+static const char SUP_INDEX_MAGIC[8] = { 'S', 'U', 'P', 'I', 'D', 'X', '0', '1' };
+static const size_t SUP_INDEX_HEADER_SIZE = 20;
+static const size_t SUP_INDEX_EPOCH_SIZE = 12;
+
+bool SupIndex::load(const char* path, u64 size)
+{
+    MappedFile file;
+    if (!file.open(path) || file.size() < SUP_INDEX_HEADER_SIZE ||
+        std::memcmp(file.data(), SUP_INDEX_MAGIC, sizeof(SUP_INDEX_MAGIC)) != 0 ||
+        load_le64(file.data() + 8) != size)
+    {
+        return false;
+    }
+    const u32 count = load_le32(file.data() + 16);
+    if ((file.size() - SUP_INDEX_HEADER_SIZE) / SUP_INDEX_EPOCH_SIZE != count)
+    {
+        return false;
+    }
+    epochs.resize(count);
+    const u8* ptr = file.data() + SUP_INDEX_HEADER_SIZE;
+    for (u32 i = 0; i < count; i++, ptr += SUP_INDEX_EPOCH_SIZE)
+    {
+        epochs[i].offset = load_le64(ptr);
+        epochs[i].presentation = load_le32(ptr + 8);
+    }
+    this->size = size;
+    return true;
+}
+
+bool SupIndex::save(const char* path) const
+{
+    std::vector<u8> buffer(SUP_INDEX_HEADER_SIZE + epochs.size() * SUP_INDEX_EPOCH_SIZE);
+    std::memcpy(&buffer[0], SUP_INDEX_MAGIC, sizeof(SUP_INDEX_MAGIC));
+    store_le64(&buffer[8], size);
+    store_le32(&buffer[16], epochs.size());
+    u8* ptr = &buffer[SUP_INDEX_HEADER_SIZE];
+    for (size_t i = 0; i < epochs.size(); i++, ptr += SUP_INDEX_EPOCH_SIZE)
+    {
+        store_le64(ptr, epochs[i].offset);
+        store_le32(ptr + 8, epochs[i].presentation);
+    }
+    std::ofstream out(path, std::ios_base::out | std::ios_base::trunc |
+                      std::ios_base::binary);
+    out.write(reinterpret_cast<const char*>(&buffer[0]), buffer.size());
+    out.close();
+    return !out.fail();
+}
+
+static bool epoch_before(u32 presentation, const SupIndex::Epoch& epoch)
+{
+    return presentation < epoch.presentation;
+}
+
+const SupIndex::Epoch* SupIndex::find(u32 presentation) const
+{
+    if (epochs.empty())
+    {
+        return NULL;
+    }
+    std::vector<Epoch>::const_iterator i =
+        std::upper_bound(epochs.begin(), epochs.end(), presentation, epoch_before);
+    return i == epochs.begin() ? &epochs.front() : &*(i - 1);
+}
+
+static bool load_subtitle(SupReader& reader, std::list<Subtitle>& subs,
+                          unsigned int jobs)
+{
+    Subtitle subtitle;
+    if (!reader.read_all(subtitle, jobs) || subtitle.images.empty())
+    {
+        return false;
+    }
+    subs.push_back(std::move(subtitle));
+    return true;
+}
+
+bool load_sup(std::istream* in, std::list<Subtitle>& subs)
+{
+    SupReader reader;
+    return reader.open(in) && load_subtitle(reader, subs, 1);
+}
+
+bool load_sup(const char* path, std::list<Subtitle>& subs, unsigned int jobs)
+{
+    SupReader reader;
+    return reader.open(path) && load_subtitle(reader, subs, jobs);
+}
+
+/* Appends segments to a buffer, the length is filled in by end() */
+class SegmentWriter
+{
+public:
+    SegmentWriter(std::vector<u8>& out)
+        : out_(out), start_(0)
+    {
+    }
+
+    void begin(u8 type, u32 pts, u32 dts)
+    {
+        start_ = out_.size();
+        out_.resize(start_ + SEGMENT_HEADER_SIZE);
+        u8* header = &out_[start_];
+        header[0] = 'P';
+        header[1] = 'G';
+        store_be32(header + 2, pts);
+        store_be32(header + 6, dts);
+        header[10] = type;
+    }
+
+    void put8(u8 x)
+    {
+        out_.push_back(x);
+    }
+
+    void put16(u16 x)
+    {
+        u8 tmp[2];
+        store_be16(tmp, x);
+        put(tmp, 2);
+    }
+
+    void put24(u32 x)
+    {
+        u8 tmp[3];
+        store_be24(tmp, x);
+        put(tmp, 3);
+    }
+
+    void put(const u8* data, size_t size)
+    {
+        out_.insert(out_.end(), data, data + size);
+    }
+
+    void end()
+    {
+        const size_t length = out_.size() - start_ - SEGMENT_HEADER_SIZE;
+        assert(length <= 0xffff);
+        store_be16(&out_[start_ + 11], length);
+    }
+
+private:
+    std::vector<u8>& out_;
+    size_t start_;
+};
+
+/* Objects that are shown together, with the palette they share */
+class Composition
+{
+public:
+    std::vector<const SubImage*> images;
+    /* per image, either its own index or the mapped pixels */
+    std::vector<const u8*> index;
+    std::vector<std::vector<u8> > mapped;
+    u32 palette[256];
+    u32 colours;
+};
+
+/* transparent pixels all become the same colour */
+static inline u32 normalize_colour(u32 rgba)
+{
+    return (rgba & 0xff) == 0 ? 0 : rgba;
+}
+
+/* One distinct colour of the images being quantized. Boxes are split and
+ * averaged on the premultiplied values, so barely visible pixels do not
+ * pull the palette towards their arbitrary colours. */
+struct HistogramEntry
+{
+    u32 rgba;
+    u32 premultiplied;
+    u32 count;
+};
+
+typedef std::vector<HistogramEntry> colour_list;
+
+static inline u32 premultiply_colour(u32 rgba)
+{
+    const u32 a = rgba & 0xff;
+    u32 out = a;
+    for (unsigned int shift = 8; shift < 32; shift += 8)
+    {
+        out |= ((((rgba >> shift) & 0xff) * a + 127) / 255) << shift;
+    }
+    return out;
+}
+
+static inline u32 unpremultiply_colour(u32 premultiplied)
+{
+    const u32 a = premultiplied & 0xff;
+    if (a == 0)
+    {
+        return 0;
+    }
+    u32 out = a;
+    for (unsigned int shift = 8; shift < 32; shift += 8)
+    {
+        out |= std::min<u32>(255, (((premultiplied >> shift) & 0xff) * 255 + a / 2) / a) << shift;
+    }
+    return out;
+}
+
+/* Median cut down to at most 256 boxes, the box averages become the
+ * palette. lookup maps every colour to its box. */
+static void median_cut(colour_list& colours, u32* palette, u32& count,
+                       std::unordered_map<u32, u8>& lookup)
+{
+    struct Box
+    {
+        size_t begin, end;
+        u64 pixels;
+    };
+    std::vector<Box> boxes;
+    Box all = { 0, colours.size(), 0 };
+    for (size_t i = 0; i < colours.size(); i++)
+    {
+        all.pixels += colours[i].count;
+    }
+    boxes.push_back(all);
+    while (boxes.size() < 256)
+    {
+        /* split the box with the widest channel range, weighted by how
+         * many pixels it covers */
+        size_t best = boxes.size();
+        unsigned int best_shift = 0;
+        double best_score = 0;
+        for (size_t b = 0; b < boxes.size(); b++)
+        {
+            const Box& box = boxes[b];
+            if (box.end - box.begin < 2)
+            {
+                continue;
+            }
+            u8 low[4] = { 255, 255, 255, 255 }, high[4] = { 0, 0, 0, 0 };
+            for (size_t i = box.begin; i < box.end; i++)
+            {
+                for (unsigned int c = 0; c < 4; c++)
+                {
+                    const u8 v = colours[i].premultiplied >> (c * 8);
+                    low[c] = std::min(low[c], v);
+                    high[c] = std::max(high[c], v);
+                }
+            }
+            for (unsigned int c = 0; c < 4; c++)
+            {
+                const double score = (double)(high[c] - low[c]) * box.pixels;
+                if (score > best_score)
+                {
+                    best = b;
+                    best_shift = c * 8;
+                    best_score = score;
+                }
+            }
+        }
+        if (best == boxes.size())
+        {
+            break;
+        }
+        Box& box = boxes[best];
+        std::sort(colours.begin() + box.begin, colours.begin() + box.end,
+                  [best_shift](const HistogramEntry& a, const HistogramEntry& b)
+                  {
+                      return ((a.premultiplied >> best_shift) & 0xff) <
+                          ((b.premultiplied >> best_shift) & 0xff);
+                  });
+        u64 below = 0;
+        size_t split = box.begin;
+        while (split < box.end - 1 && below + colours[split].count <= box.pixels / 2)
+        {
+            below += colours[split++].count;
+        }
+        if (split == box.begin)
+        {
+            below += colours[split++].count;
+        }
+        Box upper = { split, box.end, box.pixels - below };
+        box.end = split;
+        box.pixels = below;
+        boxes.push_back(upper);
+    }
+
+    /* most used first so index 0, which has the short RLE codes, is
+     * usually the transparent background */
+    std::sort(boxes.begin(), boxes.end(), [](const Box& a, const Box& b)
+              {
+                  return a.pixels > b.pixels;
+              });
+    count = boxes.size();
+    for (size_t b = 0; b < boxes.size(); b++)
+    {
+        u64 sum[4] = { 0, 0, 0, 0 };
+        for (size_t i = boxes[b].begin; i < boxes[b].end; i++)
+        {
+            for (unsigned int c = 0; c < 4; c++)
+            {
+                sum[c] += (u64)((colours[i].premultiplied >> (c * 8)) & 0xff) *
+                    colours[i].count;
+            }
+        }
+        u32 premultiplied = 0;
+        for (unsigned int c = 0; c < 4; c++)
+        {
+            premultiplied |= (u32)((sum[c] + boxes[b].pixels / 2) / boxes[b].pixels) << (c * 8);
+        }
+        palette[b] = unpremultiply_colour(premultiplied);
+    }
+
+    /* colours at the edge of a box can be closer to another box average */
+    u32 entries[256];
+    for (u32 b = 0; b < count; b++)
+    {
+        entries[b] = premultiply_colour(palette[b]);
+    }
+    for (size_t i = 0; i < colours.size(); i++)
+    {
+        u32 best = 0, best_distance = ~0u;
+        for (u32 b = 0; b < count && best_distance > 0; b++)
+        {
+            u32 distance = 0;
+            for (unsigned int shift = 0; shift < 32; shift += 8)
+            {
+                const s32 d = (s32)((colours[i].premultiplied >> shift) & 0xff) -
+                    (s32)((entries[b] >> shift) & 0xff);
+                distance += d * d;
+            }
+            if (distance < best_distance)
+            {
+                best = b;
+                best_distance = distance;
+            }
+        }
+        lookup[colours[i].rgba] = best;
+    }
+}
+
+/* Picks the palette for the images in comp and the index data to encode.
+ * Indexed images sharing one palette are used as they are. */
+static void quantize(Composition& comp)
+{
+    bool shared = true;
+    for (size_t i = 0; i < comp.images.size() && shared; i++)
+    {
+        shared = comp.images[i]->indexed() &&
+            std::memcmp(comp.images[i]->palette, comp.images[0]->palette,
+                        sizeof(comp.images[0]->palette)) == 0;
+    }
+    comp.index.clear();
+    comp.mapped.clear();
+    if (shared)
+    {
+        comp.colours = 0;
+        for (size_t i = 0; i < comp.images.size(); i++)
+        {
+            const SubImage& sub = *comp.images[i];
+            for (u32 p = 0; p < sub.width * sub.height; p++)
+            {
+                comp.colours = std::max<u32>(comp.colours, sub.index[p] + 1);
+            }
+            comp.index.push_back(sub.index);
+        }
+        std::memcpy(comp.palette, comp.images[0]->palette, sizeof(comp.palette));
+        return;
+    }
+
+    std::unordered_map<u32, u32> histogram;
+    for (size_t i = 0; i < comp.images.size(); i++)
+    {
+        const SubImage& sub = *comp.images[i];
+        for (u32 p = 0; p < sub.width * sub.height; p++)
+        {
+            histogram[normalize_colour(sub.pixel(p))]++;
+        }
+    }
+    colour_list colours;
+    colours.reserve(histogram.size());
+    for (std::unordered_map<u32, u32>::const_iterator i(histogram.begin());
+         i != histogram.end(); ++i)
+    {
+        HistogramEntry entry = { i->first, premultiply_colour(i->first), i->second };
+        colours.push_back(entry);
+    }
+    std::unordered_map<u32, u8> lookup;
+    median_cut(colours, comp.palette, comp.colours, lookup);
+
+    comp.mapped.resize(comp.images.size());
+    for (size_t i = 0; i < comp.images.size(); i++)
+    {
+        const SubImage& sub = *comp.images[i];
+        std::vector<u8>& mapped = comp.mapped[i];
+        mapped.resize(sub.width * sub.height);
+        u32 last = 0;
+        u8 last_index = lookup[0];
+        for (u32 p = 0; p < sub.width * sub.height; p++)
+        {
+            const u32 rgba = normalize_colour(sub.pixel(p));
+            if (rgba != last)
+            {
+                last = rgba;
+                last_index = lookup[rgba];
+            }
+            mapped[p] = last_index;
+        }
+        comp.index.push_back(mapped.data());
     }
-    for (image_list::iterator img(imgs.begin()); img != imgs.end(); ++img)
+}
+
+/* The inverse of decode_object(). Runs longer than a code can hold are
+ * split, two pixel runs of a colour are cheaper as two literals. */
+static void encode_rle(const u8* index, u32 width, u32 height, std::vector<u8>& out)
+{
+    for (u32 y = 0; y < height; y++)
     {
-        u8* ptr = img->data->ptr;
-        for (u16 i = 0; i < img->size; i++, ptr++)
+        const u8* row = index + y * width;
+        u32 x = 0;
+        while (x < width)
         {
-            switch (extended)
+            const u8 colour = row[x];
+            u32 run = 1;
+            while (x + run < width && run < 0x3fff && row[x + run] == colour)
+            {
+                run++;
+            }
+            x += run;
+            if (colour == 0)
             {
-            case 0:
-                if (*ptr == 0)
+                out.push_back(0);
+                if (run < 64)
                 {
-                    /* 00 ... */
-                    extended = 1;
+                    out.push_back(run);
                 }
                 else
                 {
-                    /* Standard pixel */
-                    *pixel++ = palette[*ptr];
-                }
-                break;
-            case 1:
-                if (*ptr == 0)
-                {
-                    /* 00 00 -> new line */
-                    row += subimg.width;
-                    pixel = row;
-                    extended = 0;
+                    out.push_back(0x40 | (run >> 8));
+                    out.push_back(run);
                 }
-                else if ((*ptr & 0xc0) == 0x00)
+            }
+            else if (run < 3)
+            {
+                out.insert(out.end(), run, colour);
+            }
+            else
+            {
+                out.push_back(0);
+                if (run < 64)
                 {
-                    /* 00 0x -> x zeroes */
-                    size = *ptr;
-                    while (size-- > 0)
-                    {
-                        *pixel++ = palette[0];
-                    }
-                    extended = 0;
+                    out.push_back(0x80 | run);
                 }
                 else
                 {
-                    extended = 2;
-                    arg1 = *ptr;
-                }
-                break;
-            case 2:
-                switch (arg1 & 0xc0)
-                {
-                case 0x40:
-                    /* 00 4x yy -> xyy zeroes */
-                    size = ((arg1 & 0x3f) << 8) + *ptr;
-                    while (size-- > 0)
-                    {
-                        *pixel++ = palette[0];
-                    }
-                    extended = 0;
-                    break;
-                case 0x80:
-                    /* 00 8x yy -> x times value yy */
-                    size = arg1 & 0x3f;
-                    while (size-- > 0)
-                    {
-                        *pixel++ = palette[*ptr];
-                    }
-                    extended = 0;
-                    break;
-                case 0xc0:
-                    arg2 = *ptr;
-                    extended = 3;
-                    break;
-                default:
-                    std::cerr << "invalid rle code" << std::endl;
-                    return false;
-                }
-                break;
-            case 3:
-                /* 00 cx yy zz -> xyy times value zz */
-                size = ((arg1 & 0x3f) << 8) | arg2;
-                while (size-- > 0)
-                {
-                    *pixel++ = palette[*ptr];
+                    out.push_back(0xc0 | (run >> 8));
+                    out.push_back(run);
                 }
-                extended = 0;
-                break;
+                out.push_back(colour);
             }
         }
+        out.push_back(0);
+        out.push_back(0);
     }
-    return true;
 }
 
-bool create_subimage(Subtitle& subtitle, entry& last, entry& current)
+/* Writes an object as ODS fragments that fit the 16 bit segment length.
+ * The first fragment carries the size, which the total counts too. */
+static void write_object(SegmentWriter& writer, u16 id, u8 version, u16 width,
+                         u16 height, const std::vector<u8>& rle, u32 pts,
+                         u32 dts)
 {
-    if (current.timecodes.empty())
-    {
-        std::cerr << "entry without timecodes" << std::endl;
-        reset_entry(last);
-        reset_entry(current);
-        return false;
-    }
-    if (current.timecodes.size() > 1)
-    {
-        std::cerr << "multiple timecodes before end?" << std::endl;
-        reset_entry(last);
-        reset_entry(current);
-        return false;
-    }
-    Timecode current_tc = current.timecodes.front();
-    if ((current_tc.comp_state & TIMECODE_COMP_STATE_EPOCH_START) != 0)
+    const u32 total = rle.size() + 4;
+    size_t pos = 0;
+    do
     {
-        if (!last.timecodes.empty())
+        const bool first = pos == 0;
+        const size_t room = 0xffff - (first ? 11 : 4);
+        const size_t size = std::min(room, rle.size() - pos);
+        const bool last = pos + size == rle.size();
+        writer.begin(SEGMENT_TYPE_IMAGE, pts, dts);
+        writer.put16(id);
+        writer.put8(version);
+        writer.put8((first ? IMAGE_FLAG_FIRST : 0) | (last ? IMAGE_FLAG_LAST : 0));
+        if (first)
         {
-            std::cerr << "both last and current are start timecodes" << std::endl;
-            reset_entry(last);
+            writer.put24(total);
+            writer.put16(width);
+            writer.put16(height);
         }
-        transfer_entry(last, current);
-        return true;
+        writer.put(rle.data() + pos, size);
+        writer.end();
+        pos += size;
+    } while (pos < rle.size());
+}
+
+/* 90kHz ticks, rounded the way create_subimage() converts back */
+static u64 to_ticks(u64 s, u64 ns)
+{
+    return s * 90000 + (ns + 5555) / 11111;
+}
+
+/* Decoder model of the BD graphics spec: objects are decoded at
+ * 128 Mbit/s, the graphics plane is written at 256 Mbit/s */
+static u32 decode_ticks(u64 pixels)
+{
+    return (pixels * 8 * 90000 + 128000000 - 1) / 128000000;
+}
+
+static u32 transfer_ticks(u64 pixels)
+{
+    return (pixels * 8 * 90000 + 256000000 - 1) / 256000000;
+}
+
+/* t - d, or 0 at the very start of the stream */
+static inline u64 earlier(u64 t, u64 d)
+{
+    return t > d ? t - d : 0;
+}
+
+/* Writes comp as an epoch of its own: one display set showing it at
+ * start and one clearing it at end */
+static void write_composition(SegmentWriter& writer, const Composition& comp,
+                              u16 screen_width, u16 screen_height,
+                              color_matrix_t matrix, u64 start, u64 end,
+                              u16& comp_num)
+{
+    /* one window per object, or one around both if they overlap */
+    Window windows[2];
+    u8 window_of[2] = { 0, 1 };
+    unsigned int window_count = comp.images.size();
+    for (size_t i = 0; i < comp.images.size(); i++)
+    {
+        const SubImage& sub = *comp.images[i];
+        windows[i].id = i;
+        windows[i].x = sub.x;
+        windows[i].y = sub.y;
+        windows[i].width = sub.width;
+        windows[i].height = sub.height;
     }
-    else
+    if (window_count == 2)
     {
-        if (last.timecodes.empty())
+        Window& a = windows[0];
+        const Window& b = windows[1];
+        if (a.x < b.x + b.width && b.x < a.x + a.width &&
+            a.y < b.y + b.height && b.y < a.y + a.height)
         {
-            std::cerr << "two non-start timecodes after each other" << std::endl;
-            reset_entry(last);
-            reset_entry(current);
-            return false;
+            const u16 x1 = std::max(a.x + a.width, b.x + b.width);
+            const u16 y1 = std::max(a.y + a.height, b.y + b.height);
+            a.x = std::min(a.x, b.x);
+            a.y = std::min(a.y, b.y);
+            a.width = x1 - a.x;
+            a.height = y1 - a.y;
+            window_of[1] = 0;
+            window_count = 1;
         }
     }
 
-    Timecode last_tc = last.timecodes.front();
-
-    if (subtitle.width == 0)
+    u64 draw = 0, decode = 0;
+    for (unsigned int i = 0; i < window_count; i++)
     {
-        subtitle.width = last_tc.width;
-        subtitle.height = last_tc.height;
+        draw += transfer_ticks((u64)windows[i].width * windows[i].height);
     }
-    if (subtitle.fps == 0 && last_tc.fps != TIMECODE_FPS_UNKNOWN)
+    for (size_t i = 0; i < comp.images.size(); i++)
     {
-        switch (last_tc.fps)
-        {
-        case TIMECODE_FPS_24:
-            subtitle.fps = 24;
-            break;
-        case TIMECODE_FPS_UNKNOWN:
-            break;
-        }
+        decode += decode_ticks((u64)comp.images[i]->width * comp.images[i]->height);
+    }
+    const u64 init = transfer_ticks((u64)screen_width * screen_height);
+    const u64 dts = earlier(start, init + decode + draw);
+
+    writer.begin(SEGMENT_TYPE_TIMECODES, start, dts);
+    writer.put16(screen_width);
+    writer.put16(screen_height);
+    writer.put8(TIMECODE_FPS_24);
+    writer.put16(comp_num++);
+    writer.put8(TIMECODE_COMP_STATE_EPOCH_START);
+    writer.put8(0); /* palette update */
+    writer.put8(0); /* palette id */
+    writer.put8(comp.images.size());
+    for (size_t i = 0; i < comp.images.size(); i++)
+    {
+        writer.put16(i);
+        writer.put8(window_of[i]);
+        writer.put8(comp.images[i]->forced ? OBJ_FLAG_FORCED_ON : 0);
+        writer.put16(comp.images[i]->x);
+        writer.put16(comp.images[i]->y);
     }
+    writer.end();
 
-    /* 90kHz */
-    u64 start_s = last_tc.presentation / 90000;
-    u64 start_ns = (last_tc.presentation % 90000) * 11111;
-    u64 duration_s = current_tc.presentation / 90000;
-    u64 duration_ns = (current_tc.presentation % 90000) * 11111;
-    duration_s -= start_s;
-    if (duration_ns < start_ns)
+    writer.begin(SEGMENT_TYPE_WINDOW, earlier(start, draw), dts);
+    writer.put8(window_count);
+    for (unsigned int i = 0; i < window_count; i++)
     {
-        duration_s -= 1;
-        duration_ns += 1000000000ul;
+        writer.put8(windows[i].id);
+        writer.put16(windows[i].x);
+        writer.put16(windows[i].y);
+        writer.put16(windows[i].width);
+        writer.put16(windows[i].height);
     }
-    duration_ns -= start_ns;
+    writer.end();
 
-    for (Timecode::object_list::iterator i(last_tc.objects.begin());
-         i != last_tc.objects.end(); ++i)
+    writer.begin(SEGMENT_TYPE_PALETTE, dts, dts);
+    writer.put8(0); /* id */
+    writer.put8(0); /* version */
+    for (u32 i = 0; i < comp.colours; i++)
     {
-        Window wnd = last.windows[i->window_id];
-        SubImage subimg(wnd.width, wnd.height);
-        subimg.x = wnd.x;
-        subimg.y = wnd.y;
-        subimg.forced = (i->flags & OBJ_FLAG_FORCED_ON);
-        subimg.start_s = start_s;
-        subimg.start_ns = start_ns;
-        subimg.duration_s = duration_s;
-        subimg.duration_ns = duration_ns;
+        u8 y, cb, cr;
+        rgb_to_ycbcr(comp.palette[i], matrix, y, cb, cr);
+        writer.put8(i);
+        writer.put8(y);
+        writer.put8(cr);
+        writer.put8(cb);
+        writer.put8(comp.palette[i]);
+    }
+    writer.end();
 
-        render(subimg, last.palettes[last_tc.palette_id], last.images);
+    u64 decoded = dts + init;
+    std::vector<u8> rle;
+    for (size_t i = 0; i < comp.images.size(); i++)
+    {
+        const SubImage& sub = *comp.images[i];
+        rle.clear();
+        encode_rle(comp.index[i], sub.width, sub.height, rle);
+        const u64 object_dts = decoded;
+        decoded += decode_ticks((u64)sub.width * sub.height);
+        write_object(writer, i, 0, sub.width, sub.height, rle, decoded,
+                     object_dts);
+    }
 
-        subtitle.images.push_back(subimg);
+    writer.begin(SEGMENT_TYPE_END, decoded, decoded);
+    writer.end();
+
+    /* the clearing display set only wipes the windows */
+    const u64 clear_dts = earlier(end, draw);
+    writer.begin(SEGMENT_TYPE_TIMECODES, end, clear_dts);
+    writer.put16(screen_width);
+    writer.put16(screen_height);
+    writer.put8(TIMECODE_FPS_24);
+    writer.put16(comp_num++);
+    writer.put8(TIMECODE_COMP_STATE_NORMAL);
+    writer.put8(0);
+    writer.put8(0);
+    writer.put8(0);
+    writer.end();
+
+    writer.begin(SEGMENT_TYPE_WINDOW, clear_dts, clear_dts);
+    writer.put8(window_count);
+    for (unsigned int i = 0; i < window_count; i++)
+    {
+        writer.put8(windows[i].id);
+        writer.put16(windows[i].x);
+        writer.put16(windows[i].y);
+        writer.put16(windows[i].width);
+        writer.put16(windows[i].height);
     }
+    writer.end();
 
-    reset_entry(last);
-    reset_entry(current);
-    return true;
+    writer.begin(SEGMENT_TYPE_END, clear_dts, clear_dts);
+    writer.end();
 }
 
-bool read_palette(std::istream* in, Palette& palette, u16 length)
+static bool save_subtitle(std::ostream* out, const Subtitle& subtitle,
+                          color_matrix_t matrix)
 {
-    if (length < 2)
+    u32 screen_width = subtitle.width, screen_height = subtitle.height;
+    if (screen_width == 0 || screen_height == 0)
     {
-        return false;
+        for (Subtitle::subimages_t::const_iterator i(subtitle.images.begin());
+             i != subtitle.images.end(); ++i)
+        {
+            screen_width = std::max(screen_width, i->x + i->width);
+            screen_height = std::max(screen_height, i->y + i->height);
+        }
     }
-    palette.id = readu8(in);
-    palette.version = readu8(in);
-    length -= 2;
-    if ((length % 5) != 0)
+    if (matrix == COLOR_MATRIX_AUTO)
     {
-        return false;
+        matrix = color_matrix_for(screen_width, screen_height);
     }
-    while (length > 0)
+
+    std::vector<u8> buffer;
+    SegmentWriter writer(buffer);
+    u16 comp_num = 0;
+    Composition comp;
+    Subtitle::subimages_t::const_iterator i(subtitle.images.begin());
+    while (i != subtitle.images.end())
     {
-        PaletteEntry entry;
-        entry.index = readu8(in);
-        entry.y = readu8(in);
-        entry.cr = readu8(in);
-        entry.cb = readu8(in);
-        entry.alpha = readu8(in);
-        palette.entries.push_back(entry);
-        length -= 5;
+        /* images with the same timing are one composition, PGS shows at
+         * most two objects at once */
+        comp.images.clear();
+        comp.images.push_back(&*i);
+        for (++i; i != subtitle.images.end() && comp.images.size() < 2 &&
+                 i->start_s == comp.images[0]->start_s &&
+                 i->start_ns == comp.images[0]->start_ns &&
+                 i->duration_s == comp.images[0]->duration_s &&
+                 i->duration_ns == comp.images[0]->duration_ns; ++i)
+        {
+            comp.images.push_back(&*i);
+        }
+        for (size_t n = 0; n < comp.images.size(); n++)
+        {
+            if (comp.images[n]->width == 0 || comp.images[n]->height == 0)
+            {
+                comp.images.erase(comp.images.begin() + n--);
+            }
+        }
+        if (comp.images.empty())
+        {
+            continue;
+        }
+
+        const SubImage& first = *comp.images[0];
+        const u64 start = to_ticks(first.start_s, first.start_ns);
+        u64 end = start + to_ticks(first.duration_s, first.duration_ns);
+        if (i != subtitle.images.end())
+        {
+            /* only one epoch can be on screen */
+            end = std::max(start, std::min(end, to_ticks(i->start_s, i->start_ns)));
+        }
+
+        quantize(comp);
+        write_composition(writer, comp, screen_width, screen_height, matrix,
+                          start, end, comp_num);
+        if (buffer.size() >= (1 << 20))
+        {
+            out->write((const char*)buffer.data(), buffer.size());
+            stat_add(STAT_BYTES_WRITTEN, buffer.size());
+            buffer.clear();
+        }
     }
-    return true;
+    out->write((const char*)buffer.data(), buffer.size());
+    stat_add(STAT_BYTES_WRITTEN, buffer.size());
+    return !out->fail();
 }
 
-bool read_image(std::istream* in, Image& image, u16 length)
+bool save_sup(std::ostream* out, std::list<Subtitle>& subs, color_matrix_t matrix)
 {
-    if (length < 4)
-    {
-        return false;
-    }
-    image.id = readu16(in);
-    image.version = readu8(in);
-    image.flags = readu8(in);
-    length -= 4;
-    if ((image.flags & IMAGE_FLAG_FIRST) == IMAGE_FLAG_FIRST)
+    StatTimer timer(STAT_TIME_ENCODE);
+    for (std::list<Subtitle>::const_iterator i(subs.begin()); i != subs.end(); ++i)
     {
-        if (length < 7)
+        if (!save_subtitle(out, *i, matrix))
         {
             return false;
         }
-        image.total = readu24(in);
-        image.width = readu16(in);
-        image.height = readu16(in);
-        length -= 7;
     }
-    image.size = length;
-    image.data = new RefData<u8>(new u8[image.size]);
-    in->read(reinterpret_cast<char*>(image.data->ptr), image.size);
     return true;
 }
 
-long read_window(std::istream* in, Window& window, u16 length)
+/* Coordinates for rescale_pgs(). Left and top edges round down and right
+ * and bottom edges of windows round up, so scaled objects stay inside
+ * their scaled windows. The small bias keeps exact ratios such as
+ * 1920 * 2 / 3 from landing one below. Everything is clamped to the
+ * scaled screen, a screen of 0 only limits to what fits in 16 bits. */
+class CoordScale
 {
-    if (length < 9)
+public:
+    CoordScale(double factor, u16 screen)
+        : factor_(factor), scaled_(std::max(1.0, std::floor(screen * factor + 0.5))),
+          limit_(screen == 0 ? 0xffff : std::min(scaled_, 65535.0))
     {
-        return -1;
     }
-    window.id = readu8(in);
-    window.x = readu16(in);
-    window.y = readu16(in);
-    window.width = readu16(in);
-    window.height = readu16(in);
-    return 9;
-}
 
-bool read_timecode(std::istream* in, Timecode& timecode, u16 length)
+    /* false if the scaled screen is too large for a PCS */
+    bool fits() const
+    {
+        return scaled_ <= 0xffff;
+    }
+
+    u16 screen() const
+    {
+        return limit_;
+    }
+
+    u16 down(u32 v) const
+    {
+        return std::min<double>(limit_, std::floor(v * factor_ + 1e-6));
+    }
+
+    u16 up(u32 v) const
+    {
+        return std::min<double>(limit_, std::ceil(v * factor_ - 1e-6));
+    }
+
+    /* object sizes never reach 0 */
+    u16 size(u32 v) const
+    {
+        return v == 0 ? 0 : std::max<u16>(1, down(v));
+    }
+
+private:
+    double factor_;
+    double scaled_;
+    u16 limit_;
+};
+
+/* fragments of an object still being read, with the timestamps of the
+ * first one */
+class PendingObject
 {
-    u8 count;
-    u16 pos;
-    if (length < 11)
+public:
+    image_list fragments;
+    u32 presentation, decoding;
+};
+
+/* Crop rectangles written by rescale_pgs() and not yet checked against
+ * their object, offset is where the four fields start in the output */
+class CropPatch
+{
+public:
+    CropPatch(size_t offset, u16 id)
+        : offset(offset), id(id)
     {
-        return false;
     }
-    timecode.width = readu16(in);
-    timecode.height = readu16(in);
-    switch (readu8(in))
+
+    size_t offset;
+    u16 id;
+};
+
+typedef std::map<u16, std::pair<u16, u16> > object_sizes;
+
+/* Pulls the span at start, length back inside 0 - limit */
+static void clamp_span(u8* start, u8* length, u16 limit)
+{
+    u16 s = load_be16(start);
+    if (s >= limit)
     {
-    case TIMECODE_FPS_24:
-        timecode.fps = TIMECODE_FPS_24;
-        break;
-    default:
-        timecode.fps = TIMECODE_FPS_UNKNOWN;
-        break;
+        s = limit - 1;
     }
-    timecode.comp_num = readu16(in);
-    timecode.comp_state = readu8(in);
-    timecode.palette_flags = readu8(in);
-    timecode.palette_id = readu8(in);
-    count = readu8(in);
-    pos = 11;
-    while (count-- > 0)
+    store_be16(start, s);
+    store_be16(length, std::min<u32>(load_be16(length), limit - s));
+}
+
+/* Crop edges are rounded outward but object sizes down, so a crop can end
+ * a pixel past its scaled object. The objects of a display set are known
+ * by its END, that is where the crops are clamped. */
+static void clamp_crops(std::vector<u8>& buffer, const std::vector<CropPatch>& crops,
+                        const object_sizes& sizes)
+{
+    for (std::vector<CropPatch>::const_iterator i(crops.begin()); i != crops.end(); ++i)
     {
-        Object object;
-        long ret = read_object(in, object, length - pos);
-        if (ret < 0)
+        object_sizes::const_iterator size = sizes.find(i->id);
+        if (size == sizes.end() || size->second.first == 0 ||
+            size->second.second == 0)
         {
-            return false;
+            continue;
         }
-        pos += ret;
-        timecode.objects.push_back(object);
+        u8* crop = &buffer[i->offset];
+        clamp_span(crop, crop + 4, size->second.first);
+        clamp_span(crop + 2, crop + 6, size->second.second);
     }
-    return pos == length;
 }
 
-long read_object(std::istream* in, Object& object, u16 length)
+bool rescale_pgs(const char* path, std::ostream* out, double factor)
 {
-    if (length < 8)
+    MappedFile file;
+    std::ifstream* stream = NULL;
+    SegmentReader* reader = open_segment_reader(path, file, stream);
+    if (reader == NULL)
     {
-        return -1;
+        delete stream;
+        return false;
+    }
+
+    std::vector<u8> buffer;
+    SegmentWriter writer(buffer);
+    std::map<u16, PendingObject> pending;
+    /* scaled sizes of the objects defined so far */
+    object_sizes sizes;
+    std::vector<CropPatch> crops;
+    DecodedObject obj;
+    std::vector<u8> rle;
+    bool ok = true;
+    Timecode tc;
+    Segment segment;
+    while (ok && reader->next(segment))
+    {
+        const u8* in = segment.data;
+        switch (segment.type)
+        {
+        case SEGMENT_TYPE_TIMECODES:
+        {
+            if (!read_timecode(in, tc, segment.length))
+            {
+                std::cerr << "bad timecode" << std::endl;
+                ok = false;
+                break;
+            }
+            const CoordScale sx(factor, tc.width), sy(factor, tc.height);
+            if (!sx.fits() || !sy.fits())
+            {
+                std::cerr << "scaled screen too large" << std::endl;
+                ok = false;
+                break;
+            }
+            writer.begin(segment.type, segment.presentation, segment.decoding);
+            writer.put16(sx.screen());
+            writer.put16(sy.screen());
+            /* frame rate up to the object count is kept as it is */
+            writer.put(in + 4, 7);
+            for (Timecode::object_list::const_iterator i(tc.objects.begin());
+                 i != tc.objects.end(); ++i)
+            {
+                writer.put16(i->id);
+                writer.put8(i->window_id);
+                writer.put8(i->flags);
+                writer.put16(sx.down(i->x));
+                writer.put16(sy.down(i->y));
+                if ((i->flags & OBJ_FLAG_CROPPED) != 0)
+                {
+                    const u16 x0 = sx.down(i->crop_x), y0 = sy.down(i->crop_y);
+                    crops.push_back(CropPatch(buffer.size(), i->id));
+                    writer.put16(x0);
+                    writer.put16(y0);
+                    writer.put16(sx.up(i->crop_x + i->crop_width) - x0);
+                    writer.put16(sy.up(i->crop_y + i->crop_height) - y0);
+                }
+            }
+            writer.end();
+            break;
+        }
+        case SEGMENT_TYPE_WINDOW:
+        {
+            /* windows are clamped to the screen of the last PCS */
+            const CoordScale sx(factor, tc.width), sy(factor, tc.height);
+            if (segment.length < 1)
+            {
+                std::cerr << "bad window" << std::endl;
+                ok = false;
+                break;
+            }
+            writer.begin(segment.type, segment.presentation, segment.decoding);
+            writer.put8(in[0]);
+            u16 pos = 1;
+            for (u8 count = in[0]; count > 0; count--)
+            {
+                Window window;
+                long ret = read_window(in + pos, window, segment.length - pos);
+                if (ret < 0)
+                {
+                    std::cerr << "bad window" << std::endl;
+                    ok = false;
+                    break;
+                }
+                pos += ret;
+                const u16 x = sx.down(window.x), y = sy.down(window.y);
+                writer.put8(window.id);
+                writer.put16(x);
+                writer.put16(y);
+                writer.put16(sx.up(window.x + window.width) - x);
+                writer.put16(sy.up(window.y + window.height) - y);
+            }
+            writer.end();
+            break;
+        }
+        case SEGMENT_TYPE_IMAGE:
+        {
+            Image image;
+            if (!read_image(in, image, segment.length))
+            {
+                std::cerr << "bad image" << std::endl;
+                ok = false;
+                break;
+            }
+            image.data = segment.owner;
+            if (image.data != NULL)
+            {
+                image.data->retain();
+            }
+            PendingObject& object = pending[image.id];
+            if ((image.flags & IMAGE_FLAG_FIRST) != 0)
+            {
+                object.fragments.clear();
+                object.presentation = segment.presentation;
+                object.decoding = segment.decoding;
+            }
+            else if (object.fragments.empty())
+            {
+                std::cerr << "image continues nothing" << std::endl;
+                ok = false;
+                break;
+            }
+            object.fragments.push_back(image);
+            if ((image.flags & IMAGE_FLAG_LAST) == 0)
+            {
+                break;
+            }
+
+            {
+                StatTimer timer(STAT_TIME_DECODE);
+                if (!decode_object(object.fragments, obj))
+                {
+                    ok = false;
+                    break;
+                }
+            }
+            const CoordScale scale(factor, 0);
+            SubImage src(obj.width, obj.height, SubImage::INDEXED);
+            SubImage dst(scale.size(obj.width), scale.size(obj.height),
+                         SubImage::INDEXED);
+            std::memcpy(src.index, obj.index.data(), obj.index.size());
+            if (dst.width > 0 && dst.height > 0)
+            {
+                StatTimer timer(STAT_TIME_SCALE);
+                NNScaler()(src, dst);
+                stat_add(STAT_PIXELS_SCALED, obj.index.size());
+            }
+            StatTimer timer(STAT_TIME_ENCODE);
+            rle.clear();
+            encode_rle(dst.index, dst.width, dst.height, rle);
+            write_object(writer, image.id, image.version, dst.width, dst.height,
+                         rle, object.presentation, object.decoding);
+            sizes[image.id] = std::make_pair((u16)dst.width, (u16)dst.height);
+            stat_add(STAT_IMAGES);
+            pending.erase(image.id);
+            break;
+        }
+        default:
+            /* palettes and everything else do not depend on the size */
+            writer.begin(segment.type, segment.presentation, segment.decoding);
+            writer.put(in, segment.length);
+            writer.end();
+            break;
+        }
+        if (segment.type == SEGMENT_TYPE_END)
+        {
+            clamp_crops(buffer, crops, sizes);
+            crops.clear();
+        }
+        /* unchecked crops keep their display set in the buffer */
+        if (crops.empty() && buffer.size() >= (1 << 20))
+        {
+            out->write((const char*)buffer.data(), buffer.size());
+            stat_add(STAT_BYTES_WRITTEN, buffer.size());
+            buffer.clear();
+        }
     }
-    object.id = readu16(in);
-    object.window_id = readu8(in);
-    object.flags = readu8(in);
-    object.x = readu16(in);
-    object.y = readu16(in);
-    return 8;
+    ok = ok && !reader->bad();
+    clamp_crops(buffer, crops, sizes);
+    out->write((const char*)buffer.data(), buffer.size());
+    stat_add(STAT_BYTES_WRITTEN, buffer.size());
+    pending.clear();
+    delete reader;
+    delete stream;
+    return ok && !out->fail();
 }
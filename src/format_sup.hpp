@@ -1,12 +1,107 @@
 #ifndef FORMAT_SUP_HPP
 #define FORMAT_SUP_HPP
 
+#include "colorspace.hpp"
 #include "subtitle.hpp"
 
 #include <iostream>
 #include <list>
+#include <vector>
+
+/* Where each epoch of a .sup starts. Epochs decode independently of what
+ * came before, so a reader can start at any of them. Built from the
+ * segment headers alone, payloads are skipped. */
+class SupIndex
+{
+public:
+    class Epoch
+    {
+    public:
+        /* byte offset of the epoch start PCS and its PTS in 90kHz */
+        u64 offset;
+        u32 presentation;
+    };
+
+    SupIndex()
+        : size(0)
+    {
+    }
+
+    bool build(const char* path);
+    bool build(const u8* data, u64 size);
+    /* The sidecar is only loaded if it was built for a file of size bytes */
+    bool load(const char* path, u64 size);
+    bool save(const char* path) const;
+
+    /* the last epoch starting at or before presentation, or the first */
+    const Epoch* find(u32 presentation) const;
+
+    /* size of the indexed file */
+    u64 size;
+    std::vector<Epoch> epochs;
+};
+
+/* Pull based decoder, yields one SubImage at a time as soon as the display
+ * set that ends it has been read. Only the current epoch is kept in memory. */
+class SupReader
+{
+public:
+    SupReader();
+    ~SupReader();
+
+    bool open(std::istream* in);
+    /* Maps path into memory if possible, falls back to reading it as a
+     * stream. "-" reads from stdin. */
+    bool open(const char* path);
+
+    /* Decode to palette indices (SubImage::INDEXED) instead of RGBA */
+    void set_indexed(bool indexed);
+    /* Cut each image down to the bounding box of its visible pixels, with
+     * x and y moved to match. On by default, otherwise every image covers
+     * its whole window. */
+    void set_crop(bool crop);
+    /* YCbCr matrix for palettes, by default picked from the frame size */
+    void set_color_matrix(color_matrix_t matrix);
+    /* Only yield images visible between start and end, both nanoseconds
+     * like SubImage times. With an index the input skips ahead to the
+     * epoch that covers start, otherwise it is decoded from the
+     * beginning. Call right after open(), returns false if the input
+     * cannot seek. */
+    bool set_range(u64 start, u64 end, const SupIndex* index = NULL);
+
+    /* Returns false at end of stream or on error, check bad() */
+    bool next(SubImage& image);
+    /* Appends everything next() would yield to subtitle and sets its
+     * screen size and fps. A mapped file that has not been read from yet
+     * is split at epoch starts and decoded on up to jobs threads. */
+    bool read_all(Subtitle& subtitle, unsigned int jobs = 1);
+    bool bad() const;
+
+    /* Screen size and fps, 0 until known */
+    u32 width() const;
+    u32 height() const;
+    u16 fps() const;
+
+private:
+    SupReader(const SupReader&);
+    SupReader& operator=(const SupReader&);
+
+    void reset();
+
+    class Impl;
+    Impl* impl_;
+};
 
 bool load_sup(std::istream* in, std::list<Subtitle>& subs);
-bool save_sup(std::ostream* out, std::list<Subtitle>& subs);
+/* jobs as for SupReader::read_all() */
+bool load_sup(const char* path, std::list<Subtitle>& subs, unsigned int jobs = 1);
+/* matrix converts the RGBA images back to YCbCr palettes, by default picked
+ * from the screen size */
+bool save_sup(std::ostream* out, std::list<Subtitle>& subs,
+              color_matrix_t matrix = COLOR_MATRIX_AUTO);
+/* Scales path segment by segment into out: objects are decoded to palette
+ * indices, scaled nearest neighbour and encoded again, positions and
+ * sizes are scaled, palettes and timing are copied as they are. */
+bool rescale_pgs(const char* path, std::ostream* out, double factor);
 
 #endif /* FORMAT_SUP_HPP */
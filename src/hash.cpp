@@ -0,0 +1,151 @@
+#include "hash.hpp"
+#include "byteorder.hpp"
+
+#include <cstring>
+
+namespace {
+
+const u64 PRIME1 = 0x9e3779b185ebca87ull;
+const u64 PRIME2 = 0xc2b2ae3d27d4eb4full;
+const u64 PRIME3 = 0x165667b19e3779f9ull;
+const u64 PRIME4 = 0x85ebca77c2b2ae63ull;
+const u64 PRIME5 = 0x27d4eb2f165667c5ull;
+
+inline u64 rotl(u64 x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline u64 round(u64 acc, u64 input)
+{
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+inline u64 merge(u64 acc, u64 val)
+{
+    acc ^= round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+struct CRCTable
+{
+    u32 entry[256];
+};
+
+constexpr CRCTable make_crc_table()
+{
+    CRCTable table = {};
+    for (u32 i = 0; i < 256; i++)
+    {
+        u32 c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table.entry[i] = c;
+    }
+    return table;
+}
+
+constexpr CRCTable crc_table = make_crc_table();
+
+}
+
+XXH64::XXH64(u64 seed)
+    : seed_(seed), total_(0), buffered_(0)
+{
+    acc_[0] = seed + PRIME1 + PRIME2;
+    acc_[1] = seed + PRIME2;
+    acc_[2] = seed;
+    acc_[3] = seed - PRIME1;
+}
+
+void XXH64::update(const void* data, size_t size)
+{
+    const u8* p = static_cast<const u8*>(data);
+    const u8* end = p + size;
+    total_ += size;
+    if (buffered_ + size < sizeof(buffer_))
+    {
+        std::memcpy(buffer_ + buffered_, p, size);
+        buffered_ += size;
+        return;
+    }
+    if (buffered_ > 0)
+    {
+        size_t fill = sizeof(buffer_) - buffered_;
+        std::memcpy(buffer_ + buffered_, p, fill);
+        p += fill;
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            acc_[i] = round(acc_[i], load_le64(buffer_ + i * 8));
+        }
+        buffered_ = 0;
+    }
+    for (; end - p >= 32; p += 32)
+    {
+        acc_[0] = round(acc_[0], load_le64(p));
+        acc_[1] = round(acc_[1], load_le64(p + 8));
+        acc_[2] = round(acc_[2], load_le64(p + 16));
+        acc_[3] = round(acc_[3], load_le64(p + 24));
+    }
+    buffered_ = end - p;
+    std::memcpy(buffer_, p, buffered_);
+}
+
+u64 XXH64::digest() const
+{
+    u64 h;
+    if (total_ >= 32)
+    {
+        h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) +
+            rotl(acc_[3], 18);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            h = merge(h, acc_[i]);
+        }
+    }
+    else
+    {
+        h = seed_ + PRIME5;
+    }
+    h += total_;
+
+    const u8* p = buffer_;
+    const u8* end = buffer_ + buffered_;
+    for (; end - p >= 8; p += 8)
+    {
+        h ^= round(0, load_le64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (end - p >= 4)
+    {
+        h ^= (u64)load_le32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+u32 crc32(const void* data, size_t size, u32 crc)
+{
+    const u8* p = static_cast<const u8*>(data);
+    crc = ~crc;
+    while (size-- > 0)
+    {
+        crc = crc_table.entry[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
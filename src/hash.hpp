@@ -0,0 +1,30 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include "common.hpp"
+
+#include <cstddef>
+
+/* Streaming XXH64. Data can be fed in any number of pieces, the digest
+ * is the same as for the whole buffer at once. */
+class XXH64
+{
+public:
+    XXH64(u64 seed = 0);
+
+    void update(const void* data, size_t size);
+    u64 digest() const;
+
+private:
+    u64 acc_[4];
+    u64 seed_;
+    u64 total_;
+    u8 buffer_[32];
+    size_t buffered_;
+};
+
+/* CRC-32 as used by zlib and PNG. Pass the previous result as crc to
+ * continue over several buffers. */
+u32 crc32(const void* data, size_t size, u32 crc = 0);
+
+#endif /* HASH_HPP */
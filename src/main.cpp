@@ -1,11 +1,27 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <list>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <cstring>
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.hpp"
 #include "scale.hpp"
 #include "format_sup.hpp"
 #include "bitmap.hpp"
+#include "byteorder.hpp"
+#include "hash.hpp"
+#include "png.hpp"
+#include "stats.hpp"
+#include "work_queue.hpp"
 
 using namespace std;
 
@@ -17,12 +33,11 @@ void verify_nn(SubImage& sub) {
 		}
 		cout <<endl;
 	}
-	assert(sub.rgba[0] == 0);
-	assert(sub.rgba[3] == 10);
+	assert(sub.rgba[0] == 5);
+	assert(sub.rgba[3] == 15);
 }
 
 void verify_bl(SubImage& sub) {
-	assert(sub.rgba[0] == 0);
 	cout <<"BL scaled image: " <<endl;
 	for(u32 y = 0; y < sub.height; ++y) {
 		for(u32 x = 0; x < sub.width; ++x) {
@@ -30,6 +45,37 @@ void verify_bl(SubImage& sub) {
 		}
 		cout <<endl;
 	}
+	/* centre aligned, the same averages as area scaling */
+	assert(sub.rgba[0] == 3);
+	assert(sub.rgba[3] == 13);
+}
+
+bool same_pixels(const SubImage& a, const SubImage& b) {
+	return a.width == b.width && a.height == b.height &&
+		memcmp(a.rgba, b.rgba, a.width * a.height * sizeof(u32)) == 0;
+}
+
+/* SIMD kernels must match the scalar reference bit for bit */
+void test_simd(const ScaleKernels* kernels) {
+	if(kernels == NULL)
+		return;
+	cout <<"Testing " <<kernels->name <<" kernels against scalar" <<endl;
+	srand(1);
+	for(int i = 0; i < 50; ++i) {
+		SubImage img(1 + rand() % 300, 1 + rand() % 100);
+		for(u32 p = 0; p < img.width * img.height; ++p)
+			img.rgba[p] = (rand() & 0xffff) << 16 | (rand() & 0xffff);
+		float scale = 0.1f + (rand() % 300) / 100.0f;
+
+		SubImage ref_nn = scale_helper(img, scale, NNScaler(scale_kernels_scalar()), false);
+		SubImage simd_nn = scale_helper(img, scale, NNScaler(*kernels), false);
+		assert(same_pixels(ref_nn, simd_nn));
+
+		SubImage ref_bl = scale_helper(img, scale, BLScaler(scale_kernels_scalar()), false);
+		SubImage simd_bl = scale_helper(img, scale, BLScaler(*kernels), false);
+		assert(same_pixels(ref_bl, simd_bl));
+	}
+	cout <<"done" <<endl;
 }
 
 void test_scale() {
@@ -48,54 +94,712 @@ void test_scale() {
 	verify_nn(scaled_nn);
 	cout <<"done" <<endl;
 
+	cout <<"Testing indexed nearest-neighbor scaling" <<endl;
+	SubImage indexed(size, size, SubImage::INDEXED);
+	for(u32 i = 0; i < size * size; ++i) {
+		indexed.index[i] = i;
+		indexed.palette[i] = i;
+	}
+	SubImage scaled_indexed = scale_nn(indexed, 0.5f, false);
+	assert(scaled_indexed.indexed());
+	for(u32 i = 0; i < scaled_nn.width * scaled_nn.height; ++i)
+		assert(scaled_indexed.pixel(i) == scaled_nn.rgba[i]);
+	SubImage expanded = scale_bl(indexed, 0.5f, false);
+	assert(!expanded.indexed());
+	cout <<"done" <<endl;
+
 	cout <<"Testing bilinear scaling" <<endl;
 	SubImage scaled_bl = scale_bl(img, 0.5f, false);
 	verify_bl(scaled_bl);
 	cout <<"done" <<endl;
+
+	cout <<"Testing area scaling" <<endl;
+	SubImage scaled_area = scale_area(img, 0.5f, false);
+	/* averages of 0 1 4 5 and 10 11 14 15, rounded up */
+	assert(scaled_area.rgba[0] == 3);
+	assert(scaled_area.rgba[3] == 13);
+	cout <<"done" <<endl;
+
+	cout <<"Testing premultiplied alpha" <<endl;
+	SubImage edge(2, 1);
+	edge.rgba[0] = 0xffffffff;
+	edge.rgba[1] = 0x00000000;
+	SubImage scaled_edge = scale_bl(edge, 2.0f, false);
+	/* partly covered white, not grey */
+	assert(scaled_edge.rgba[1] == 0xffffffbf);
+	assert(scaled_edge.rgba[2] == 0xffffff40);
+	cout <<"done" <<endl;
+
+	cout <<"Testing target frame scaling" <<endl;
+	/* 1920x1080 to 720x576 anamorphic, 0.375 across and 0.5333 down */
+	const ScaleTarget pal(1920, 1080, 720, 576);
+	SubImage placed(8, 4);
+	memset(placed.rgba, 0xff, 8 * 4 * sizeof(u32));
+	placed.x = 960;
+	placed.y = 540;
+	placed.start_s = 12;
+	placed.duration_ns = 500000000;
+	placed.forced = true;
+	SubImage moved = scale_bl(placed, pal, false);
+	assert(moved.x == 360 && moved.y == 288);
+	assert(moved.width == 3 && moved.height == 2);
+	assert(moved.start_s == 12 && moved.duration_ns == 500000000 && moved.forced);
+	assert(pal.scale_x(1920) == 720 && pal.scale_y(1080) == 576);
+	cout <<"done" <<endl;
+
+	test_simd(scale_kernels_sse2());
+	test_simd(scale_kernels_avx2());
+}
+
+struct ScaleJob
+{
+    SubImage image;
+    ScaleTarget target;
+    std::string filename;
+};
+
+/* format is ignored when writing PNG */
+static void scale_worker(WorkQueue<ScaleJob>* queue, scale_filter_t filter,
+                         bool png, bitmap_format_t format)
+{
+    ScaleJob job;
+    while (queue->pop(job))
+    {
+        SubImage scaled = scale_filter(job.image, job.target, filter);
+        bool written = png ? writePng(job.filename, scaled)
+            : writeBitmap(job.filename, scaled, format);
+        if (!written)
+        {
+            cerr << "unable to write " << job.filename << endl;
+        }
+    }
+}
+
+/* FACTOR on the command line, a number or a target frame size WxH */
+struct ScaleArg
+{
+    ScaleArg()
+        : factor(1), width(0), height(0)
+    {
+    }
+
+    /* the mapping for a stream with src_width x src_height frames */
+    ScaleTarget target(u32 src_width, u32 src_height) const
+    {
+        if (width > 0)
+        {
+            return ScaleTarget(src_width, src_height, width, height);
+        }
+        return ScaleTarget(factor);
+    }
+
+    double factor;
+    u32 width, height;
+};
+
+static bool parse_scale_arg(const char* str, ScaleArg& arg)
+{
+    char* end;
+    if (strchr(str, 'x') != NULL)
+    {
+        arg.width = strtoul(str, &end, 10);
+        if (end == str || *end != 'x')
+        {
+            return false;
+        }
+        str = end + 1;
+        arg.height = strtoul(str, &end, 10);
+        return end != str && *end == '\0' && arg.width > 0 && arg.height > 0;
+    }
+    arg.factor = strtod(str, &end);
+    return end != str && *end == '\0' && arg.factor > 0;
+}
+
+/* Scales everything in reader into a new PGS stream at path. The screen
+ * and the positions are scaled along with the images, the palettes are
+ * encoded with matrix. */
+static int rescale_sup(SupReader& reader, const ScaleArg& scale,
+                       scale_filter_t filter, color_matrix_t matrix,
+                       unsigned int jobs, const char* path)
+{
+    std::list<Subtitle> subs(1);
+    Subtitle& subtitle = subs.front();
+    Subtitle decoded;
+    /* epochs decode in parallel, scaling stays in order */
+    reader.read_all(decoded, jobs);
+    const ScaleTarget target = scale.target(reader.width(), reader.height());
+    for (Subtitle::subimages_t::iterator i(decoded.images.begin());
+         i != decoded.images.end(); ++i)
+    {
+        subtitle.images.push_back(scale_filter(*i, target, filter));
+    }
+    decoded.images.clear();
+    subtitle.width = target.scale_x(reader.width());
+    subtitle.height = target.scale_y(reader.height());
+    subtitle.fps = reader.fps();
+
+    std::ofstream out(path, std::ios_base::out | std::ios_base::trunc |
+                      std::ios_base::binary);
+    bool saved = out.is_open() && save_sup(&out, subs, matrix);
+    out.close();
+    if (!saved || out.fail())
+    {
+        cerr << "unable to write " << path << endl;
+    }
+    return (saved && !out.fail() && !reader.bad()) ? 0 : 1;
+}
+
+/* Identifies the content of a bitmap file. Timing does not matter and
+ * the position only through the scaled size, which can differ by a pixel
+ * for the same image at another place. */
+static u64 hash_subimage(const SubImage& sub, const ScaleTarget& target)
+{
+    XXH64 hash;
+    const u32 geometry[5] = { sub.width, sub.height, sub.indexed(),
+                              target.width(sub), target.height(sub) };
+    hash.update(geometry, sizeof(geometry));
+    if (sub.indexed())
+    {
+        hash.update(sub.index, sub.width * sub.height);
+        hash.update(sub.palette, sizeof(sub.palette));
+    }
+    else
+    {
+        hash.update(sub.rgba, sub.width * sub.height * sizeof(u32));
+    }
+    return hash.digest();
+}
+
+static void put_segment(string& out, u8 type, const u8* payload, u16 length) {
+	u8 header[13] = { 'P', 'G' };
+	header[10] = type;
+	store_be16(header + 11, length);
+	out.append((const char*)header, sizeof(header));
+	out.append((const char*)payload, length);
+}
+
+/* A 101x3 object cropped to all of itself scales to 50x1 at 0.5, the
+ * crop must not come out 51x2 */
+void test_rescale_crop() {
+	cout <<"Testing rescaled crops of odd sized objects" <<endl;
+	string sup;
+	u8 pcs[27] = { 0 };
+	store_be16(pcs, 1920);
+	store_be16(pcs + 2, 1080);
+	pcs[4] = 0x10;
+	pcs[7] = 0x80;
+	pcs[10] = 1;
+	pcs[14] = 0x80;
+	store_be16(pcs + 15, 100);
+	store_be16(pcs + 17, 100);
+	store_be16(pcs + 23, 101);
+	store_be16(pcs + 25, 3);
+	put_segment(sup, 0x16, pcs, sizeof(pcs));
+	u8 wds[10] = { 1, 0 };
+	store_be16(wds + 2, 100);
+	store_be16(wds + 4, 100);
+	store_be16(wds + 6, 101);
+	store_be16(wds + 8, 3);
+	put_segment(sup, 0x17, wds, sizeof(wds));
+	const u8 pds[7] = { 0, 0, 1, 235, 128, 128, 255 };
+	put_segment(sup, 0x14, pds, sizeof(pds));
+	/* each line is 101 pixels of colour 1 */
+	u8 ods[11 + 3 * 6] = { 0, 0, 0, 0xc0 };
+	store_be24(ods + 4, 4 + 3 * 6);
+	store_be16(ods + 7, 101);
+	store_be16(ods + 9, 3);
+	for(int line = 0; line < 3; ++line) {
+		u8* rle = ods + 11 + line * 6;
+		rle[0] = 0;
+		rle[1] = 0xc0;
+		rle[2] = 101;
+		rle[3] = 1;
+		rle[4] = rle[5] = 0;
+	}
+	put_segment(sup, 0x15, ods, sizeof(ods));
+	put_segment(sup, 0x80, NULL, 0);
+
+	char path[] = "/tmp/subscale-test-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	const ssize_t written = write(fd, sup.data(), sup.size());
+	close(fd);
+	assert(written == (ssize_t)sup.size());
+	ostringstream out;
+	bool ok = rescale_pgs(path, &out, 0.5);
+	unlink(path);
+	assert(ok);
+
+	const string scaled = out.str();
+	u32 crop_w = 0, crop_h = 0, object_w = 0, object_h = 0;
+	for(size_t p = 0; p + 13 <= scaled.size();) {
+		const u8* segment = (const u8*)scaled.data() + p;
+		const u8* payload = segment + 13;
+		if(segment[10] == 0x16) {
+			crop_w = load_be16(payload + 23);
+			crop_h = load_be16(payload + 25);
+		} else if(segment[10] == 0x15) {
+			object_w = load_be16(payload + 7);
+			object_h = load_be16(payload + 9);
+		}
+		p += 13 + load_be16(segment + 11);
+	}
+	assert(object_w == 50 && object_h == 1);
+	assert(crop_w == 50 && crop_h == 1);
+	cout <<"done" <<endl;
+}
+
+/* Equal images share a file only if they scale to the same size */
+void test_dedup() {
+	cout <<"Testing dedup keys" <<endl;
+	const ScaleTarget half(0.5);
+	SubImage images[3];
+	for(u32 n = 0; n < 3; ++n) {
+		images[n] = SubImage(3, 3);
+		for(u32 p = 0; p < 9; ++p)
+			images[n].rgba[p] = 0xffffffff;
+		images[n].x = n;
+	}
+	/* 3 pixels at x = 0 and 2 scale to 2 pixels, at x = 1 to 1 */
+	const u64 at0 = hash_subimage(images[0], half);
+	const u64 at1 = hash_subimage(images[1], half);
+	const u64 at2 = hash_subimage(images[2], half);
+	SubImage scaled0 = scale_bl(images[0], half, false);
+	SubImage scaled1 = scale_bl(images[1], half, false);
+	SubImage scaled2 = scale_bl(images[2], half, false);
+	assert(at0 == at2);
+	assert(scaled0.width == scaled2.width && scaled0.height == scaled2.height);
+	assert(at0 != at1);
+	assert(scaled0.width != scaled1.width);
+	cout <<"done" <<endl;
+}
+
+/* Parses [[hh:]mm:]ss[.fff] into nanoseconds */
+static bool parse_time(const char* str, u64& ns)
+{
+    u64 seconds = 0;
+    for (int fields = 0; ; fields++)
+    {
+        char* end;
+        const unsigned long value = strtoul(str, &end, 10);
+        if (end == str || fields == 3)
+        {
+            return false;
+        }
+        seconds = seconds * 60 + value;
+        str = end;
+        if (*str != ':')
+        {
+            break;
+        }
+        str++;
+    }
+    ns = seconds * 1000000000ull;
+    if (*str == '.')
+    {
+        u64 scale = 100000000ull;
+        for (str++; *str >= '0' && *str <= '9'; str++, scale /= 10)
+        {
+            ns += (*str - '0') * scale;
+        }
+    }
+    return *str == '\0';
+}
+
+/* sidecar index written by the i mode */
+static std::string index_path(const char* path)
+{
+    return std::string(path) + ".idx";
+}
+
+/* Uses the sidecar index if it matches path, otherwise scans path */
+static bool open_index(const char* path, SupIndex& index)
+{
+    struct stat st;
+    if (stat(path, &st) == 0 && index.load(index_path(path).c_str(), st.st_size))
+    {
+        return true;
+    }
+    return index.build(path);
+}
+
+/* long options without a short form */
+enum
+{
+    OPT_NO_CROP = 256,
+    OPT_START,
+    OPT_END,
+    OPT_STATS,
+    OPT_PROGRESS,
+};
+
+static bool print_stats = false;
+static double progress_interval = 0;
+
+/* Handles --stats and --progress, which every converting mode takes */
+static bool parse_stats_option(int opt, const char* arg)
+{
+    if (opt == OPT_STATS)
+    {
+        if (strcmp(arg, "json") != 0)
+        {
+            cerr << "unknown stats format " << arg << endl;
+            return false;
+        }
+        print_stats = true;
+        return true;
+    }
+    progress_interval = arg != NULL ? atof(arg) : 1;
+    if (!(progress_interval > 0))
+    {
+        cerr << "bad progress interval " << arg << endl;
+        return false;
+    }
+    return true;
+}
+
+static void finish_stats()
+{
+    stop_progress();
+    if (print_stats)
+    {
+        write_stats_json(cerr);
+    }
+}
+
+/* Stats are printed at exit, whichever way main() returns */
+static void begin_stats()
+{
+    if (print_stats)
+    {
+        stats_enable_timing();
+    }
+    if (progress_interval > 0)
+    {
+        start_progress(progress_interval);
+    }
+    /* statics are destroyed in reverse order of construction and atexit
+     * registration, building the pool first keeps it alive for the
+     * handler */
+    pixel_pool();
+    atexit(finish_stats);
+}
+
+static void usage(const char* argv0)
+{
+    cerr << "usage: " << argv0 << " t" << endl
+         << "       " << argv0 << " w [OPTIONS] FACTOR|WxH FILE.sup" << endl
+         << "       " << argv0 << " s [OPTIONS] FACTOR|WxH FILE.sup OUT.sup" << endl
+         << "       " << argv0 << " r [OPTIONS] FACTOR FILE.sup OUT.sup" << endl
+         << "       " << argv0 << " i FILE.sup" << endl
+         << endl
+         << "  -j, --jobs=N          threads for scaling in w, decoding in s (0 = one per CPU)" << endl
+         << "  -f, --filter=FILTER   nn, bilinear (default), area, bicubic or lanczos" << endl
+         << "  -m, --matrix=MATRIX   YCbCr matrix: auto (default), 601 or 709" << endl
+         << "  -b, --bpp=FORMAT      bitmap format: 32 (default), 24, 8 or rle8" << endl
+         << "  -p, --png             write PNG with alpha instead of bitmaps" << endl
+         << "  -d, --dedup           write identical images once and reuse the file" << endl
+         << "      --no-crop         keep whole windows instead of cropping to the content" << endl
+         << "      --start=TIME      skip images that end before [[hh:]mm:]ss[.fff]" << endl
+         << "      --end=TIME        stop at images that start at or after TIME" << endl
+         << "      --stats=json      print counters and stage times to stderr at exit" << endl
+         << "      --progress[=SECS] print the position every SECS (default 1) seconds" << endl
+         << endl
+         << "WxH scales the video frame to W by H, each axis on its own." << endl
+         << "r rescales a .sup without leaving palette indices (nearest neighbour)," << endl
+         << "palettes are kept as they are. It takes --stats and --progress only." << endl
+         << "i writes FILE.sup.idx, which --start uses to seek instead of decoding" << endl
+         << "everything before TIME." << endl;
 }
 
 int main(int argc, char** argv)
 {
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
     if (*argv[1] == 't')
     {
         test_scale();
+        test_dedup();
+        test_rescale_crop();
         return 0;
     }
-    else if(*argv[1] == 'w')
-    {
-    	assert(argc == 4);
-    	float factor = atof(argv[2]);
-    	cout <<"Scaling factor " <<factor <<endl;
-    	std::list<Subtitle> subtitles;
-        std::ifstream* in = new std::ifstream();
-        in->open(argv[3], std::ios_base::in | std::ios_base::binary);
-        load_sup(in, subtitles);
-        delete in;
-        unsigned int i = 1;
+    else if(*argv[1] == 'w' || *argv[1] == 's')
+    {
+        /* w writes scaled images and an index, s a scaled .sup */
+        const bool sup = *argv[1] == 's';
+        static const struct option long_options[] = {
+            { "jobs", required_argument, NULL, 'j' },
+            { "filter", required_argument, NULL, 'f' },
+            { "matrix", required_argument, NULL, 'm' },
+            { "bpp", required_argument, NULL, 'b' },
+            { "png", no_argument, NULL, 'p' },
+            { "dedup", no_argument, NULL, 'd' },
+            { "no-crop", no_argument, NULL, OPT_NO_CROP },
+            { "start", required_argument, NULL, OPT_START },
+            { "end", required_argument, NULL, OPT_END },
+            { "stats", required_argument, NULL, OPT_STATS },
+            { "progress", optional_argument, NULL, OPT_PROGRESS },
+            { NULL, 0, NULL, 0 }
+        };
+        bool crop = true;
+        u64 start = 0, end = ~(u64)0;
+        bool dedup = false;
+        bitmap_format_t format = BITMAP_32;
+        bool png = false;
+        color_matrix_t matrix = COLOR_MATRIX_AUTO;
+        unsigned int jobs = 1;
+        scale_filter_t filter = SCALE_FILTER_BILINEAR;
+        int opt;
+        /* options follow the mode */
+        while ((opt = getopt_long(argc - 1, argv + 1, "j:f:m:b:pd", long_options, NULL)) != -1)
+        {
+            switch (opt)
+            {
+            case 'j':
+                jobs = strtoul(optarg, NULL, 10);
+                if (jobs == 0)
+                {
+                    jobs = std::thread::hardware_concurrency();
+                    if (jobs == 0)
+                    {
+                        jobs = 1;
+                    }
+                }
+                break;
+            case 'f':
+                if (!parse_scale_filter(optarg, filter))
+                {
+                    cerr << "unknown filter " << optarg << endl;
+                    return 1;
+                }
+                break;
+            case 'm':
+                if (!parse_color_matrix(optarg, matrix))
+                {
+                    cerr << "unknown matrix " << optarg << endl;
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (!parse_bitmap_format(optarg, format))
+                {
+                    cerr << "unknown bitmap format " << optarg << endl;
+                    return 1;
+                }
+                break;
+            case 'p':
+                png = true;
+                break;
+            case 'd':
+                dedup = true;
+                break;
+            case OPT_NO_CROP:
+                crop = false;
+                break;
+            case OPT_START:
+            case OPT_END:
+                if (!parse_time(optarg, opt == OPT_START ? start : end))
+                {
+                    cerr << "bad time " << optarg << endl;
+                    return 1;
+                }
+                break;
+            case OPT_STATS:
+            case OPT_PROGRESS:
+                if (!parse_stats_option(opt, optarg))
+                {
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (argc - 1 - optind != (sup ? 3 : 2))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        begin_stats();
+        ScaleArg scale;
+        if (!parse_scale_arg(argv[1 + optind], scale))
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* path = argv[2 + optind];
+        if (scale.width > 0)
+        {
+            cout <<"Scaling to " <<scale.width <<"x" <<scale.height <<endl;
+        }
+        else
+        {
+            cout <<"Scaling factor " <<scale.factor <<endl;
+        }
+        SupReader reader;
+        /* NN never blends, so it can stay in palette indices until the
+         * bitmap is written */
+        reader.set_indexed(filter == SCALE_FILTER_NN);
+        reader.set_crop(crop);
+        reader.set_color_matrix(matrix);
+        if (!reader.open(path))
+        {
+            cerr << "unable to open " << path << endl;
+            return 1;
+        }
+        if (start > 0 || end != ~(u64)0)
+        {
+            /* without an index everything before start is decoded */
+            SupIndex index;
+            const bool indexed = start > 0 && strcmp(path, "-") != 0 &&
+                                 open_index(path, index);
+            if (!reader.set_range(start, end, indexed ? &index : NULL))
+            {
+                cerr << "unable to seek in " << path << endl;
+                return 1;
+            }
+        }
+        if (sup)
+        {
+            return rescale_sup(reader, scale, filter, matrix, jobs, argv[3 + optind]);
+        }
+        WorkQueue<ScaleJob> queue(2 * jobs);
+        std::vector<std::thread> workers;
+        for (unsigned int n = 0; n < jobs; ++n)
+        {
+            workers.push_back(std::thread(scale_worker, &queue, filter, png, format));
+        }
+        /* one subtitle per stream. Names and index lines are assigned here
+         * in input order, the workers only fill in the files. */
+        unsigned int i = 1, j = 1;
         std::ofstream* out = new std::ofstream();
         out->open("test.txt", std::ios_base::out);
-        for (std::list<Subtitle>::iterator sub(subtitles.begin()); sub != subtitles.end(); ++sub, ++i)
+        /* files already written by content hash, when deduplicating */
+        std::map<u64, std::string> written;
+        ScaleJob job;
+        while (reader.next(job.image))
         {
-            unsigned int j = 1;
-            for (Subtitle::subimages_t::iterator subimg(sub->images.begin()); subimg != sub->images.end(); ++subimg, ++j)
+            char filename[50], tmp[50];
+            SubImage& subimg = job.image;
+            bool duplicate = false;
+            u64 hash = 0;
+            /* the frame size is known once the first image is read */
+            job.target = scale.target(reader.width(), reader.height());
+            if (dedup)
+            {
+                hash = hash_subimage(subimg, job.target);
+                std::map<u64, std::string>::const_iterator found = written.find(hash);
+                if (found != written.end())
+                {
+                    snprintf(filename, sizeof(filename), "%s", found->second.c_str());
+                    duplicate = true;
+                    stat_add(STAT_DEDUP_HITS);
+                }
+            }
+            if (!duplicate)
             {
-                char filename[50], tmp[50];
-                snprintf(filename, sizeof(filename), "test%02u-%02u.bmp",
-                         i, j);
-                SubImage scaled = scale_bl(*subimg, factor);
-                writeBitmap(filename, scaled);
-                /* time in hh:mm:ss.ms, duration ss.ms */
-                snprintf(tmp, sizeof(tmp), "%02u:%02u:%02u.%03u, %02u.%03u",
-                         (unsigned int)(subimg->start_s / (60 * 60)),
-                         (unsigned int)((subimg->start_s % (60 * 60)) / 60),
-                         (unsigned int)(subimg->start_s % 60),
-                         (unsigned int)(subimg->start_ns / 1000000ul),
-                         (unsigned int)subimg->duration_s,
-                         (unsigned int)(subimg->duration_ns / 1000000ul));
-                *out << tmp << ": " << filename << std::endl;
+                snprintf(filename, sizeof(filename), "test%02u-%02u.%s",
+                         i, j++, png ? "png" : "bmp");
+                if (dedup)
+                {
+                    written[hash] = filename;
+                }
             }
+            /* time in hh:mm:ss.ms, duration ss.ms */
+            snprintf(tmp, sizeof(tmp), "%02u:%02u:%02u.%03u, %02u.%03u",
+                     (unsigned int)(subimg.start_s / (60 * 60)),
+                     (unsigned int)((subimg.start_s % (60 * 60)) / 60),
+                     (unsigned int)(subimg.start_s % 60),
+                     (unsigned int)(subimg.start_ns / 1000000ul),
+                     (unsigned int)subimg.duration_s,
+                     (unsigned int)(subimg.duration_ns / 1000000ul));
+            *out << tmp << ": " << filename << std::endl;
+            if (duplicate)
+            {
+                continue;
+            }
+            job.filename = filename;
+            queue.push(std::move(job));
+        }
+        queue.close();
+        for (size_t n = 0; n < workers.size(); ++n)
+        {
+            workers[n].join();
         }
         out->close();
         delete out;
+        return reader.bad() ? 1 : 0;
+    }
+    else if (*argv[1] == 'r')
+    {
+        static const struct option long_options[] = {
+            { "stats", required_argument, NULL, OPT_STATS },
+            { "progress", optional_argument, NULL, OPT_PROGRESS },
+            { NULL, 0, NULL, 0 }
+        };
+        int opt;
+        while ((opt = getopt_long(argc - 1, argv + 1, "", long_options, NULL)) != -1)
+        {
+            if (opt != OPT_STATS && opt != OPT_PROGRESS)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            if (!parse_stats_option(opt, optarg))
+            {
+                return 1;
+            }
+        }
+        if (argc - 1 - optind != 3)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const double factor = atof(argv[1 + optind]);
+        /* even a one pixel screen would not fit, rescale_pgs() checks the
+         * real screen size */
+        if (!(factor > 0) || factor > 0xffff)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        begin_stats();
+        const char* path = argv[3 + optind];
+        std::ofstream out(path, std::ios_base::out | std::ios_base::trunc |
+                          std::ios_base::binary);
+        if (!out.is_open())
+        {
+            cerr << "unable to write " << path << endl;
+            return 1;
+        }
+        return rescale_pgs(argv[2 + optind], &out, factor) ? 0 : 1;
+    }
+    else if (*argv[1] == 'i')
+    {
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        SupIndex index;
+        if (!index.build(argv[2]))
+        {
+            cerr << "unable to index " << argv[2] << endl;
+            return 1;
+        }
+        const std::string out = index_path(argv[2]);
+        if (!index.save(out.c_str()))
+        {
+            cerr << "unable to write " << out << endl;
+            return 1;
+        }
+        cout << index.epochs.size() << " epochs" << endl;
+        return 0;
     }
+    usage(argv[0]);
+    return 1;
 }
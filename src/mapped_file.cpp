@@ -0,0 +1,54 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+    : data_(NULL), size_(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const char* path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+#endif
+    data_ = static_cast<const u8*>(ptr);
+    size_ = st.st_size;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (data_ != NULL)
+    {
+        munmap(const_cast<u8*>(data_), size_);
+        data_ = NULL;
+        size_ = 0;
+    }
+}
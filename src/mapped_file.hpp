@@ -0,0 +1,41 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include "common.hpp"
+
+/* Read-only memory mapping of a whole regular file.
+ * open() fails for pipes, sockets and other non-regular files, callers are
+ * expected to fall back to stream reading in that case. */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const char* path);
+    void close();
+
+    bool is_open() const
+    {
+        return data_ != NULL;
+    }
+
+    const u8* data() const
+    {
+        return data_;
+    }
+
+    u64 size() const
+    {
+        return size_;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const u8* data_;
+    u64 size_;
+};
+
+#endif /* MAPPED_FILE_HPP */
@@ -0,0 +1,130 @@
+#include "png.hpp"
+#include "byteorder.hpp"
+#include "deflate.hpp"
+#include "hash.hpp"
+#include "stats.hpp"
+#include "subtitle.hpp"
+
+#include <fstream>
+#include <vector>
+
+#include <cstring>
+
+namespace {
+
+enum png_color_type_t
+{
+    PNG_COLOR_PALETTE = 3,
+    PNG_COLOR_RGBA = 6,
+};
+
+const u8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+/* Appends a chunk, the CRC covers type and data */
+void put_chunk(std::vector<u8>& out, const char* type, const u8* data, u32 size)
+{
+    const size_t start = out.size();
+    out.resize(start + 8);
+    store_be32(&out[start], size);
+    std::memcpy(&out[start + 4], type, 4);
+    out.insert(out.end(), data, data + size);
+    u8 crc[4];
+    store_be32(crc, crc32(&out[start + 4], size + 4));
+    out.insert(out.end(), crc, crc + 4);
+}
+
+}
+
+bool writePng(std::string path, const SubImage& sub)
+{
+    /* one set of buffers per writer thread, grown to the largest image
+     * seen */
+    static thread_local std::vector<u8> raw, compressed, file;
+    StatTimer timer(STAT_TIME_WRITE);
+
+    /* PNG has no empty images, those become a single transparent pixel */
+    const bool empty = sub.width == 0 || sub.height == 0;
+    const u32 width = empty ? 1 : sub.width;
+    const u32 height = empty ? 1 : sub.height;
+    const bool indexed = sub.indexed() && !empty;
+    const u32 bpp = indexed ? 1 : 4;
+
+    /* every row starts with its filter type, 0 (none) throughout. The
+     * compressor finds the repeats in and between rows by itself. */
+    const u32 stride = 1 + width * bpp;
+    raw.assign((size_t)stride * height, 0);
+    for (u32 y = 0; y < height && !empty; y++)
+    {
+        u8* row = &raw[(size_t)y * stride + 1];
+        if (indexed)
+        {
+            std::memcpy(row, sub.index + y * width, width);
+        }
+        else
+        {
+            const u32* src = sub.rgba + y * width;
+            for (u32 x = 0; x < width; x++)
+            {
+                store_be32(row + x * 4, src[x]);
+            }
+        }
+    }
+    compressed.clear();
+    zlib_compress(raw.data(), raw.size(), compressed);
+
+    file.assign(signature, signature + sizeof(signature));
+    u8 header[13];
+    store_be32(header, width);
+    store_be32(header + 4, height);
+    header[8] = 8; /* bit depth */
+    header[9] = indexed ? PNG_COLOR_PALETTE : PNG_COLOR_RGBA;
+    header[10] = 0; /* deflate */
+    header[11] = 0; /* adaptive filtering */
+    header[12] = 0; /* no interlace */
+    put_chunk(file, "IHDR", header, sizeof(header));
+    if (indexed)
+    {
+        /* only up to the highest index in use, tRNS stops after the last
+         * entry that is not opaque */
+        u32 colours = 0;
+        for (u32 i = 0; i < width * height; i++)
+        {
+            if (sub.index[i] >= colours)
+            {
+                colours = sub.index[i] + 1;
+            }
+        }
+        u8 plte[256 * 3], trns[256];
+        u32 transparent = 0;
+        for (u32 i = 0; i < colours; i++)
+        {
+            const u32 rgba = sub.palette[i];
+            plte[i * 3] = rgba >> 24;
+            plte[i * 3 + 1] = rgba >> 16;
+            plte[i * 3 + 2] = rgba >> 8;
+            trns[i] = rgba;
+            if (trns[i] != 0xff)
+            {
+                transparent = i + 1;
+            }
+        }
+        put_chunk(file, "PLTE", plte, colours * 3);
+        if (transparent > 0)
+        {
+            put_chunk(file, "tRNS", trns, transparent);
+        }
+    }
+    put_chunk(file, "IDAT", compressed.data(), compressed.size());
+    put_chunk(file, "IEND", NULL, 0);
+
+    std::ofstream writer(path.c_str(), std::ios::trunc | std::ios::binary);
+    writer.write((const char*)file.data(), file.size());
+    writer.close();
+    if (writer.fail())
+    {
+        return false;
+    }
+    stat_add(STAT_FILES_WRITTEN);
+    stat_add(STAT_BYTES_WRITTEN, file.size());
+    return true;
+}
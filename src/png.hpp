@@ -0,0 +1,13 @@
+#ifndef PNG_HPP
+#define PNG_HPP
+
+#include <string>
+
+class SubImage;
+
+/* Writes sub with its alpha channel, indexed images as a palette image
+ * with PLTE and tRNS, RGBA images as 8 bit RGBA. Returns false if the
+ * file could not be written. */
+bool writePng(std::string path, const SubImage& sub);
+
+#endif /* PNG_HPP */
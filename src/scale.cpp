@@ -0,0 +1,315 @@
+#include "scale.hpp"
+#include "stats.hpp"
+
+#include <cstring>
+#include <map>
+
+ScaleAxis::ScaleAxis(u32 src, u32 dst)
+	: src(src), dst(dst), nearest(dst), first(dst), second(dst), weight(dst) {
+	const u64 last = (u64)(src - 1) << 16;
+	for(u32 i = 0; i < dst; ++i) {
+		/* pixel centres line up: (i + 0.5) * src / dst - 0.5 in 16.16
+		 * fixed point, clamped to [0, src - 1] */
+		u64 centre = ((u64)(2 * i + 1) * src << 16) / (2 * (u64)dst);
+		u64 pos = centre > 0x8000 ? centre - 0x8000 : 0;
+		if(pos > last)
+			pos = last;
+		u32 frac = pos & 0xffff;
+		nearest[i] = centre >> 16;
+		first[i] = pos >> 16;
+		second[i] = first[i] + 1 < src ? first[i] + 1 : src - 1;
+		weight[i] = (frac + 0x80) >> 8;
+	}
+}
+
+namespace {
+
+struct AxisKey {
+	AxisKey(u32 src, u32 dst, const FilterKernel* kernel)
+	: src(src), dst(dst), kernel(kernel) {
+	}
+
+	bool operator<(const AxisKey& other) const {
+		if(src != other.src)
+			return src < other.src;
+		if(dst != other.dst)
+			return dst < other.dst;
+		return kernel < other.kernel;
+	}
+
+	u32 src, dst;
+	const FilterKernel* kernel;
+};
+
+/* One per thread, so lookups take no lock. Axes are shared, a scaler
+ * keeps its axis even if the cache drops it. When full, the least
+ * recently used axis goes. */
+template <class Axis>
+class AxisCache {
+public:
+	typedef std::shared_ptr<const Axis> axis_ptr;
+
+	AxisCache() : clock(0) {
+	}
+
+	axis_ptr find(const AxisKey& key, bool vertical) {
+		typename axis_map::iterator i = axes.find(key);
+		if(i == axes.end()) {
+			stat_add(vertical ? STAT_Y_AXIS_MISSES : STAT_X_AXIS_MISSES);
+			return axis_ptr();
+		}
+		stat_add(vertical ? STAT_Y_AXIS_HITS : STAT_X_AXIS_HITS);
+		i->second.used = ++clock;
+		return i->second.axis;
+	}
+
+	void insert(const AxisKey& key, const axis_ptr& axis) {
+		if(axes.size() >= 256) {
+			typename axis_map::iterator oldest = axes.begin();
+			for(typename axis_map::iterator i = axes.begin(); i != axes.end(); ++i)
+				if(i->second.used < oldest->second.used)
+					oldest = i;
+			axes.erase(oldest);
+		}
+		Entry& entry = axes[key];
+		entry.axis = axis;
+		entry.used = ++clock;
+	}
+
+private:
+	struct Entry {
+		axis_ptr axis;
+		u64 used;
+	};
+	typedef std::map<AxisKey, Entry> axis_map;
+
+	axis_map axes;
+	u64 clock;
+};
+
+}
+
+std::shared_ptr<const ScaleAxis> scale_axis(u32 src, u32 dst, bool vertical) {
+	static thread_local AxisCache<ScaleAxis> cache;
+	const AxisKey key(src, dst, NULL);
+	std::shared_ptr<const ScaleAxis> axis = cache.find(key, vertical);
+	if(!axis) {
+		axis = std::make_shared<ScaleAxis>(src, dst);
+		cache.insert(key, axis);
+	}
+	return axis;
+}
+
+std::shared_ptr<const FilterAxis> filter_axis(u32 src, u32 dst,
+                                              const FilterKernel& kernel,
+                                              bool vertical) {
+	static thread_local AxisCache<FilterAxis> cache;
+	const AxisKey key(src, dst, &kernel);
+	std::shared_ptr<const FilterAxis> axis = cache.find(key, vertical);
+	if(!axis) {
+		axis = std::make_shared<FilterAxis>(src, dst, kernel);
+		cache.insert(key, axis);
+	}
+	return axis;
+}
+
+static inline u32 div255(u32 x) {
+	x += 0x80;
+	return (x + (x >> 8)) >> 8;
+}
+
+void premultiply_row(const u32* src, u32* dst, u32 width) {
+	for(u32 x = 0; x < width; ++x) {
+		u32 pixel = src[x];
+		u32 a = pixel & 0xff;
+		if(a == 0xff) {
+			dst[x] = pixel;
+		} else {
+			dst[x] = div255((pixel >> 24) * a) << 24 |
+				div255(((pixel >> 16) & 0xff) * a) << 16 |
+				div255(((pixel >> 8) & 0xff) * a) << 8 | a;
+		}
+	}
+}
+
+namespace {
+
+/* unpremultiplied[a][c] = c * 255 / a, rounded and clamped */
+struct UnpremultiplyTable {
+	UnpremultiplyTable() {
+		memset(table[0], 0, sizeof(table[0]));
+		for(u32 a = 1; a < 256; ++a) {
+			for(u32 c = 0; c < 256; ++c) {
+				u32 v = (c * 255 + a / 2) / a;
+				table[a][c] = v > 255 ? 255 : v;
+			}
+		}
+	}
+
+	u8 table[256][256];
+};
+
+}
+
+void unpremultiply_row(u32* row, u32 width) {
+	static const UnpremultiplyTable lut;
+	for(u32 x = 0; x < width; ++x) {
+		u32 pixel = row[x];
+		u32 a = pixel & 0xff;
+		if(a == 0xff)
+			continue;
+		const u8* t = lut.table[a];
+		row[x] = (u32)t[pixel >> 24] << 24 | (u32)t[(pixel >> 16) & 0xff] << 16 |
+			(u32)t[(pixel >> 8) & 0xff] << 8 | a;
+	}
+}
+
+static void nn_row(const u32* src, u32* dst, const u32* index, u32 width) {
+	for(u32 x = 0; x < width; ++x)
+		dst[x] = src[index[x]];
+}
+
+static void bl_hrow(const u32* src, u16* dst, const u32* first,
+                    const u32* second, const u16* weight, u32 width) {
+	for(u32 x = 0; x < width; ++x) {
+		u32 a = src[first[x]];
+		u32 b = src[second[x]];
+		u32 wb = weight[x];
+		u32 wa = 256 - wb;
+		for(u32 c = 0; c < 4; ++c, a >>= 8, b >>= 8)
+			*dst++ = (a & 0xff) * wa + (b & 0xff) * wb;
+	}
+}
+
+static void bl_vrow(const u16* a, const u16* b, u32* dst, u32 width, u16 weight) {
+	u32 wb = weight;
+	u32 wa = 256 - wb;
+	for(u32 x = 0; x < width; ++x) {
+		u32 pixel = 0;
+		for(u32 c = 0; c < 4; ++c, ++a, ++b)
+			pixel |= ((*a * wa + *b * wb + 0x8000) >> 16) << (8 * c);
+		dst[x] = pixel;
+	}
+}
+
+const ScaleKernels& scale_kernels_scalar() {
+	static const ScaleKernels kernels = { "scalar", nn_row, bl_hrow, bl_vrow };
+	return kernels;
+}
+
+static const ScaleKernels& pick_kernels() {
+	const ScaleKernels* best = scale_kernels_avx2();
+	if(best == NULL)
+		best = scale_kernels_sse2();
+	if(best == NULL)
+		best = &scale_kernels_scalar();
+	return *best;
+}
+
+const ScaleKernels& scale_kernels() {
+	static const ScaleKernels& best = pick_kernels();
+	return best;
+}
+
+static void nn_index_row(const u8* src, u8* dst, const u32* index, u32 width) {
+	for(u32 x = 0; x < width; ++x)
+		dst[x] = src[index[x]];
+}
+
+void NNScaler::operator()(const SubImage& old, SubImage& scaled) const {
+	std::shared_ptr<const ScaleAxis> x = scale_axis(old.width, scaled.width, false);
+	std::shared_ptr<const ScaleAxis> y = scale_axis(old.height, scaled.height, true);
+	const ScaleAxis& xaxis = *x;
+	const ScaleAxis& yaxis = *y;
+	if(old.indexed()) {
+		/* a quarter of the memory traffic of the RGBA path */
+		for(u32 y = 0; y < scaled.height; ++y) {
+			u8* row = scaled.index + y * scaled.width;
+			if(y > 0 && yaxis.nearest[y] == yaxis.nearest[y - 1])
+				memcpy(row, row - scaled.width, scaled.width);
+			else
+				nn_index_row(old.index + yaxis.nearest[y] * old.width, row,
+				             &xaxis.nearest[0], scaled.width);
+		}
+		return;
+	}
+	for(u32 y = 0; y < scaled.height; ++y) {
+		u32* row = scaled.rgba + y * scaled.width;
+		if(y > 0 && yaxis.nearest[y] == yaxis.nearest[y - 1])
+			memcpy(row, row - scaled.width, scaled.width * sizeof(u32));
+		else
+			kernels.nn_row(old.rgba + yaxis.nearest[y] * old.width, row,
+			               &xaxis.nearest[0], scaled.width);
+	}
+}
+
+namespace {
+
+/* The two most recent horizontally scaled source rows */
+class RowCache {
+public:
+	RowCache(const SubImage& old, const ScaleAxis& axis, const ScaleKernels& kernels)
+		: old(old), axis(axis), kernels(kernels), premultiplied(old.width) {
+		for(int i = 0; i < 2; ++i) {
+			rows[i].resize(4 * axis.dst);
+			cached[i] = ~0u;
+		}
+	}
+
+	/* horizontal pass of source row y, never evicting row keep */
+	const u16* get(u32 y, u32 keep) {
+		for(int i = 0; i < 2; ++i)
+			if(cached[i] == y)
+				return &rows[i][0];
+		int slot = cached[0] == keep ? 1 : 0;
+		premultiply_row(old.rgba + y * old.width, &premultiplied[0], old.width);
+		kernels.bl_hrow(&premultiplied[0], &rows[slot][0],
+		                &axis.first[0], &axis.second[0], &axis.weight[0], axis.dst);
+		cached[slot] = y;
+		return &rows[slot][0];
+	}
+
+private:
+	const SubImage& old;
+	const ScaleAxis& axis;
+	const ScaleKernels& kernels;
+	std::vector<u32> premultiplied;
+	std::vector<u16> rows[2];
+	u32 cached[2];
+};
+
+}
+
+void BLScaler::operator()(const SubImage& old, SubImage& scaled) const {
+	std::shared_ptr<const ScaleAxis> x = scale_axis(old.width, scaled.width, false);
+	std::shared_ptr<const ScaleAxis> y = scale_axis(old.height, scaled.height, true);
+	const ScaleAxis& xaxis = *x;
+	const ScaleAxis& yaxis = *y;
+	RowCache cache(old, xaxis, kernels);
+	for(u32 y = 0; y < scaled.height; ++y) {
+		u32 first = yaxis.first[y], second = yaxis.second[y];
+		const u16* a = cache.get(first, second);
+		const u16* b = cache.get(second, first);
+		u32* row = scaled.rgba + y * scaled.width;
+		kernels.bl_vrow(a, b, row, scaled.width, yaxis.weight[y]);
+		unpremultiply_row(row, scaled.width);
+	}
+}
+
+SubImage expand_palette(const SubImage& sub) {
+	SubImage rgba(sub.width, sub.height);
+	for(u32 i = 0; i < sub.width * sub.height; ++i)
+		rgba.rgba[i] = sub.palette[sub.index[i]];
+	rgba.x = sub.x;
+	rgba.y = sub.y;
+	rgba.copy_timing(sub);
+	return rgba;
+}
+
+SubImage scale_nn(const SubImage& sub, const ScaleTarget& target, bool debug) {
+	return scale_helper(sub, target, NNScaler(), debug);
+}
+
+SubImage scale_bl(const SubImage& sub, const ScaleTarget& target, bool debug) {
+	return scale_helper(sub, target, BLScaler(), debug);
+}
@@ -1,105 +1,241 @@
 #ifndef SCALE_HPP
 #define SCALE_HPP
 
-#include <math.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
 #include "subtitle.hpp"
-#include "iostream"
 
-struct Pixel {
-	Pixel(u32 rgba) {
-		data = new u8[4];
-		memcpy(data, &rgba, 4);
+/* Maps positions and sizes from a source frame onto a target frame, each
+ * axis with a factor of its own so anamorphic conversions such as
+ * 1920x1080 to 720x576 work. */
+class ScaleTarget
+{
+public:
+	/* the same factor along both axes */
+	ScaleTarget(double factor = 1)
+	: x_factor(factor), y_factor(factor) {
 	}
-	Pixel(u8 r, u8 g, u8 b, u8 a) {
-		data = new u8[4];
-		data[0] = r;
-		data[1] = g;
-		data[2] = b;
-		data[3] = a;
+
+	/* an unknown (0) source size leaves that axis as it is */
+	ScaleTarget(u32 src_width, u32 src_height, u32 dst_width, u32 dst_height)
+	: x_factor(src_width > 0 ? (double)dst_width / src_width : 1),
+	  y_factor(src_height > 0 ? (double)dst_height / src_height : 1) {
 	}
-	Pixel operator*(float val) {
-		Pixel retr(data[0] * val, data[1] * val, data[2] * val, data[4] * val);
-		return retr;
+
+	/* Coordinates round to the nearest pixel. Sizes are best taken as the
+	 * distance between two scaled edges, so images that touch keep
+	 * touching and nothing grows past the target frame. */
+	u32 scale_x(u32 x) const {
+		return round(x, x_factor);
 	}
-	Pixel operator*(u32 val) {
-		Pixel retr(data[0] * val, data[1] * val, data[2] * val, data[4] * val);
-		return retr;
+
+	u32 scale_y(u32 y) const {
+		return round(y, y_factor);
 	}
-	Pixel operator/(float val) {
-		Pixel retr(data[0] / val, data[1] / val, data[2] / val, data[4] / val);
-		return retr;
+
+	/* size of sub once scaled, which depends on where it is */
+	u32 width(const SubImage& sub) const {
+		return scale_x(sub.x + sub.width) - scale_x(sub.x);
 	}
-	Pixel operator+(const Pixel& rhs) {
-		u8 r = data[0] + rhs.data[0];
-		u8 g = data[1] + rhs.data[1];
-		u8 b = data[2] + rhs.data[2];
-		u8 a = data[3] + rhs.data[3];
-		return Pixel(r, g, b, a);
+
+	u32 height(const SubImage& sub) const {
+		return scale_y(sub.y + sub.height) - scale_y(sub.y);
 	}
-	operator u32() {
-		u32 retr;
-		memcpy(&retr, data, 4);
-		return retr;
+
+	double x_factor, y_factor;
+
+private:
+	static u32 round(u32 v, double factor) {
+		return std::floor(v * factor + 0.5);
 	}
-	u8* data;
 };
-std::ostream& operator<<(std::ostream& out, Pixel& p) {
-	out <<"(" <<p.data[0] <<", " <<p.data[1] <<", " <<p.data[2] <<")";
-	return out;
-}
 
+/* Source sampling positions for every pixel along one axis, computed once
+ * per (source size, destination size) pair. The centre of destination
+ * pixel i maps to the centre of source coordinate (i + 0.5) * src / dst,
+ * so scaling does not shift the image towards the top-left corner. */
+class ScaleAxis
+{
+public:
+	ScaleAxis(u32 src, u32 dst);
+
+	u32 src, dst;
+	/* source pixel under the destination pixel centre */
+	std::vector<u32> nearest;
+	/* nearest source pixel at or before the position and the one after it,
+	 * clamped to the last pixel */
+	std::vector<u32> first, second;
+	/* weight of second in 8.8 fixed point, 0 - 256 */
+	std::vector<u16> weight;
+};
+
+/* Axes come from a small per-thread cache keyed by source size,
+ * destination size and, for filter_axis(), the kernel. Cropped text
+ * lines differ in width but share their heights, so each axis is cached
+ * on its own rather than per image size. vertical only picks the stats
+ * counters the lookup is reported under. */
+std::shared_ptr<const ScaleAxis> scale_axis(u32 src, u32 dst, bool vertical);
+
+/* Colour is blended in premultiplied space so transparent pixels do not
+ * bleed their (usually black) colour into glyph edges. The scalers
+ * premultiply each source row once as it is first used and convert every
+ * output row back to straight alpha through a lookup table. */
+void premultiply_row(const u32* src, u32* dst, u32 width);
+void unpremultiply_row(u32* row, u32 width);
+
+/* Row kernels used by the scalers. The scalar set is the reference, the
+ * SIMD sets must produce bit-exact identical output. */
+struct ScaleKernels {
+	const char* name;
+	void (*nn_row)(const u32* src, u32* dst, const u32* index, u32 width);
+	/* 16 bit channels (value * 256) of one horizontally scaled row */
+	void (*bl_hrow)(const u32* src, u16* dst, const u32* first,
+	                const u32* second, const u16* weight, u32 width);
+	/* blend two horizontal rows, weight of b in 8.8 fixed point */
+	void (*bl_vrow)(const u16* a, const u16* b, u32* dst, u32 width, u16 weight);
+};
+
+const ScaleKernels& scale_kernels_scalar();
+/* NULL if not built in or not supported by the running CPU */
+const ScaleKernels* scale_kernels_sse2();
+const ScaleKernels* scale_kernels_avx2();
+/* best set for the running CPU, picked on first use */
+const ScaleKernels& scale_kernels();
+
+/* Both scalers run row by row over packed RGBA, treating the four bytes of
+ * a pixel as independent channels. */
 struct NNScaler {
-	void operator()(const SubImage& old, SubImage& scaled, float scale, u32 newx, u32 newy, bool debug) {
-		u32 oldx = newx/scale;
-		u32 oldy = newy/scale;
-		if(debug)
-			printf("from (%d, %d) to (%d, %d)\n", oldx, oldy, newx, newy);
-		scaled.rgba[newx + scaled.width * newy] = old.rgba[oldx + oldy * old.width];
+	NNScaler(const ScaleKernels& kernels = scale_kernels())
+	: kernels(kernels) {
 	}
+	void operator()(const SubImage& old, SubImage& scaled) const;
+
+	/* works on palette indices directly, see scale_helper */
+	static const bool indexed = true;
+
+	const ScaleKernels& kernels;
 };
 
+/* Separable bilinear: a horizontal pass turns each needed source row into
+ * 16 bit channels (value * 256), a vertical pass blends two of those rows
+ * and rounds back to 8 bits. */
 struct BLScaler {
-	void operator()(const SubImage& old, SubImage& scaled, float scale, u32 newx, u32 newy, bool debug) {
-		u32 q1x = ceil(newx/scale);
-		u32 q1y = ceil(newy/scale);
-		u32 q2x = floor(newx/scale) + 1;
-		u32 q2y = floor(newy/scale) + 1;
+	BLScaler(const ScaleKernels& kernels = scale_kernels())
+	: kernels(kernels) {
+	}
+	void operator()(const SubImage& old, SubImage& scaled) const;
+
+	static const bool indexed = false;
 
-		if(debug)
-			printf("from q1(%d, %d) and q2(%d, %d) to (%d, %d)\n", q1x, q1y, q2x, q2y, newx, newy);
+	const ScaleKernels& kernels;
+};
+
+/* Convolution kernel for the polyphase scalers */
+struct FilterKernel {
+	const char* name;
+	/* radius in source pixels, widened by the ratio when downscaling */
+	double support;
+	/* NULL for area averaging, which uses exact pixel coverage instead */
+	double (*weight)(double x);
+};
 
-		Pixel p1 = Pixel(old.rgba[q1x + old.width * q1y]) * (1.0f-newx/scale) * (1.0f-newy/scale);
-		Pixel p2 = Pixel(old.rgba[q2x + old.width * q1y]) * newx * (1.0f - newy/scale);
-		Pixel p3 = Pixel(old.rgba[q1x + old.width * q2y]) * (1.0f - newx/scale) * newy;
-		Pixel p4 = Pixel(old.rgba[q2x + old.width * q2y]) * newx * newy;
+extern const FilterKernel area_kernel, bicubic_kernel, lanczos3_kernel;
 
-		scaled.rgba[newx + newy * scaled.width] = p1 + p2 + p3 + p4;
+/* Polyphase coefficient table for one axis. Destination pixel i is the
+ * sum of source pixels start[i] ... start[i] + taps - 1 weighted by
+ * coeff[i * taps ...] in 2.14 fixed point, the weights of taps outside the
+ * image are folded onto the edge pixels. Pixel centres are aligned. */
+class FilterAxis
+{
+public:
+	FilterAxis(u32 src, u32 dst, const FilterKernel& kernel);
+
+	u32 src, dst, taps;
+	std::vector<u32> start;
+	std::vector<s16> coeff;
+};
+
+std::shared_ptr<const FilterAxis> filter_axis(u32 src, u32 dst,
+                                              const FilterKernel& kernel,
+                                              bool vertical);
+
+/* Two pass polyphase scaler, the horizontal pass keeps 7 fractional bits
+ * per channel in 32 bit so negative lobes cannot overflow. */
+struct FilterScaler {
+	FilterScaler(const FilterKernel& kernel)
+	: kernel(kernel) {
+	}
+	void operator()(const SubImage& old, SubImage& scaled) const;
+
+	static const bool indexed = false;
+
+	const FilterKernel& kernel;
+};
+
+/* Box filter over the exact source area of each destination pixel */
+struct AreaScaler : FilterScaler {
+	AreaScaler() : FilterScaler(area_kernel) {
+	}
+};
+
+/* Keys cubic convolution, a = -0.5 */
+struct BicubicScaler : FilterScaler {
+	BicubicScaler() : FilterScaler(bicubic_kernel) {
+	}
+};
+
+struct LanczosScaler : FilterScaler {
+	LanczosScaler() : FilterScaler(lanczos3_kernel) {
 	}
 };
 
+/* RGBA copy of an indexed image, placement and timing included */
+SubImage expand_palette(const SubImage& sub);
+
+/* Scales sub into the target frame. The position is remapped, timing and
+ * the forced flag are carried over. Indexed images stay indexed if the
+ * scaler can work on indices, otherwise they are expanded to RGBA first. */
 template <class scalerType>
-SubImage scale_helper(const SubImage& sub, float scale, scalerType scaler, bool debug) {
+SubImage scale_helper(const SubImage& sub, const ScaleTarget& target, scalerType scaler, bool debug) {
+	if(sub.indexed() && !scalerType::indexed) {
+		SubImage rgba = expand_palette(sub);
+		return scale_helper(rgba, target, scaler, debug);
+	}
 	if(debug)
 		printf("old size (%d, %d)\n", sub.width, sub.height);
-	u32 scaled_width = sub.width * scale;
-	u32 scaled_height = sub.height * scale;
-	SubImage scaled(scaled_width, scaled_height);
-	for(u32 x = 0; x < scaled.width; ++x) {
-		for(u32 y = 0; y < scaled.height; ++y) {
-			scaler(sub, scaled, scale, x, y, debug);
-		}
-	}
+	SubImage scaled(target.width(sub), target.height(sub),
+	                sub.indexed() ? SubImage::INDEXED : SubImage::RGBA);
+	scaled.x = target.scale_x(sub.x);
+	scaled.y = target.scale_y(sub.y);
+	scaled.copy_timing(sub);
+	if(sub.indexed())
+		memcpy(scaled.palette, sub.palette, sizeof(scaled.palette));
+	if(scaled.width > 0 && scaled.height > 0)
+		scaler(sub, scaled);
 	if(debug)
 		printf("new size (%d, %d)\n", scaled.width, scaled.height);
 	return scaled;
 }
 
-SubImage scale_nn(const SubImage& sub, float scale, bool debug = false) {
-	return scale_helper(sub, scale, NNScaler(), debug);
-}
+SubImage scale_nn(const SubImage& sub, const ScaleTarget& target, bool debug = false);
+SubImage scale_bl(const SubImage& sub, const ScaleTarget& target, bool debug = false);
+SubImage scale_area(const SubImage& sub, const ScaleTarget& target, bool debug = false);
+SubImage scale_bicubic(const SubImage& sub, const ScaleTarget& target, bool debug = false);
+SubImage scale_lanczos(const SubImage& sub, const ScaleTarget& target, bool debug = false);
 
-SubImage scale_bl(const SubImage& sub, float scale, bool debug = false) {
-	return scale_helper(sub, scale, BLScaler(), debug);
-}
+enum scale_filter_t {
+	SCALE_FILTER_NN,
+	SCALE_FILTER_BILINEAR,
+	SCALE_FILTER_AREA,
+	SCALE_FILTER_BICUBIC,
+	SCALE_FILTER_LANCZOS,
+};
+
+SubImage scale_filter(const SubImage& sub, const ScaleTarget& target, scale_filter_t filter);
+/* accepts nn, bilinear, area, bicubic and lanczos */
+bool parse_scale_filter(const char* name, scale_filter_t& filter);
 
 #endif /* SCALE_HPP */
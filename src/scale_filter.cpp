@@ -0,0 +1,233 @@
+#include "scale.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static double bicubic(double x) {
+	const double a = -0.5;
+	x = fabs(x);
+	if(x < 1.0)
+		return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+	if(x < 2.0)
+		return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+	return 0.0;
+}
+
+static double sinc(double x) {
+	if(x == 0.0)
+		return 1.0;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double lanczos3(double x) {
+	if(fabs(x) >= 3.0)
+		return 0.0;
+	return sinc(x) * sinc(x / 3.0);
+}
+
+const FilterKernel area_kernel = { "area", 0.5, NULL };
+const FilterKernel bicubic_kernel = { "bicubic", 2.0, bicubic };
+const FilterKernel lanczos3_kernel = { "lanczos", 3.0, lanczos3 };
+
+FilterAxis::FilterAxis(u32 src, u32 dst, const FilterKernel& kernel)
+	: src(src), dst(dst), taps(0), start(dst) {
+	const double ratio = (double)src / dst;
+	const double stretch = ratio > 1.0 ? ratio : 1.0;
+	const double radius = kernel.support * stretch;
+	/* weights per destination pixel over source pixels lo[i] ... */
+	std::vector<std::vector<double> > weights(dst);
+	std::vector<u32> lo(dst);
+	for(u32 i = 0; i < dst; ++i) {
+		double center = (i + 0.5) * ratio;
+		s64 first, last;
+		if(kernel.weight == NULL) {
+			/* area covered by the destination pixel, in its own size
+			 * when upscaling */
+			double half = ratio > 1.0 ? ratio / 2 : 0.5;
+			first = (s64)floor(center - half);
+			last = (s64)ceil(center + half) - 1;
+		} else {
+			first = (s64)floor(center - 0.5 - radius);
+			last = (s64)ceil(center - 0.5 + radius);
+		}
+		s64 clo = first < 0 ? 0 : first;
+		s64 chi = last >= (s64)src ? src - 1 : last;
+		if(clo > chi)
+			clo = chi = first < 0 ? 0 : src - 1;
+		std::vector<double>& w = weights[i];
+		w.assign(chi - clo + 1, 0.0);
+		double sum = 0.0;
+		for(s64 j = first; j <= last; ++j) {
+			double v;
+			if(kernel.weight == NULL) {
+				double half = ratio > 1.0 ? ratio / 2 : 0.5;
+				double a = std::max((double)j, center - half);
+				double b = std::min((double)j + 1, center + half);
+				v = b > a ? b - a : 0.0;
+			} else {
+				v = kernel.weight((j + 0.5 - center) / stretch);
+			}
+			s64 k = j < clo ? clo : (j > chi ? chi : j);
+			w[k - clo] += v;
+			sum += v;
+		}
+		if(sum == 0.0) {
+			w.assign(1, 1.0);
+			sum = 1.0;
+		}
+		for(size_t k = 0; k < w.size(); ++k)
+			w[k] /= sum;
+		lo[i] = clo;
+		if(w.size() > taps)
+			taps = w.size();
+	}
+	coeff.assign((size_t)dst * taps, 0);
+	for(u32 i = 0; i < dst; ++i) {
+		const std::vector<double>& w = weights[i];
+		start[i] = lo[i] + taps <= src ? lo[i] : src - taps;
+		s16* c = &coeff[(size_t)i * taps + (lo[i] - start[i])];
+		int sum = 0;
+		size_t biggest = 0;
+		for(size_t k = 0; k < w.size(); ++k) {
+			c[k] = (s16)lrint(w[k] * (1 << 14));
+			sum += c[k];
+			if(fabs(w[k]) > fabs(w[biggest]))
+				biggest = k;
+		}
+		/* make the sum exact so flat areas stay flat */
+		c[biggest] += (1 << 14) - sum;
+	}
+}
+
+namespace {
+
+static void filter_hrow(const u32* src, s32* dst, const FilterAxis& axis) {
+	const s16* coeff = &axis.coeff[0];
+	for(u32 x = 0; x < axis.dst; ++x, dst += 4) {
+		const u32* p = src + axis.start[x];
+		s32 acc[4] = { 0, 0, 0, 0 };
+		for(u32 t = 0; t < axis.taps; ++t, ++coeff) {
+			u32 pixel = p[t];
+			for(u32 c = 0; c < 4; ++c, pixel >>= 8)
+				acc[c] += (s32)(pixel & 0xff) * *coeff;
+		}
+		for(u32 c = 0; c < 4; ++c)
+			dst[c] = (acc[c] + (1 << 6)) >> 7;
+	}
+}
+
+static inline u32 clamp_channel(s32 v) {
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Ring of horizontally filtered source rows, one slot per vertical tap.
+ * The vertical window only moves down, so row % taps never collides
+ * within it. */
+class FilterRows {
+public:
+	FilterRows(const SubImage& old, const FilterAxis& xaxis, u32 slots)
+		: old(old), xaxis(xaxis), premultiplied(old.width), rows(slots),
+		  cached(slots, ~0u) {
+		for(u32 i = 0; i < slots; ++i)
+			rows[i].resize(4 * xaxis.dst);
+	}
+
+	const s32* get(u32 y) {
+		u32 slot = y % rows.size();
+		if(cached[slot] != y) {
+			premultiply_row(old.rgba + y * old.width, &premultiplied[0], old.width);
+			filter_hrow(&premultiplied[0], &rows[slot][0], xaxis);
+			cached[slot] = y;
+		}
+		return &rows[slot][0];
+	}
+
+private:
+	const SubImage& old;
+	const FilterAxis& xaxis;
+	std::vector<u32> premultiplied;
+	std::vector<std::vector<s32> > rows;
+	std::vector<u32> cached;
+};
+
+}
+
+void FilterScaler::operator()(const SubImage& old, SubImage& scaled) const {
+	std::shared_ptr<const FilterAxis> x = filter_axis(old.width, scaled.width, kernel, false);
+	std::shared_ptr<const FilterAxis> y = filter_axis(old.height, scaled.height, kernel, true);
+	const FilterAxis& xaxis = *x;
+	const FilterAxis& yaxis = *y;
+	FilterRows rows(old, xaxis, yaxis.taps);
+	std::vector<s32> acc(4 * scaled.width);
+	for(u32 y = 0; y < scaled.height; ++y) {
+		const s16* coeff = &yaxis.coeff[(size_t)y * yaxis.taps];
+		std::fill(acc.begin(), acc.end(), 1 << 20);
+		for(u32 t = 0; t < yaxis.taps; ++t) {
+			if(coeff[t] == 0)
+				continue;
+			const s32* row = rows.get(yaxis.start[y] + t);
+			for(u32 i = 0; i < acc.size(); ++i)
+				acc[i] += row[i] * coeff[t];
+		}
+		u32* out = scaled.rgba + y * scaled.width;
+		for(u32 x = 0; x < scaled.width; ++x) {
+			const s32* a = &acc[4 * x];
+			out[x] = clamp_channel(a[0] >> 21) | clamp_channel(a[1] >> 21) << 8 |
+				clamp_channel(a[2] >> 21) << 16 | clamp_channel(a[3] >> 21) << 24;
+		}
+		unpremultiply_row(out, scaled.width);
+	}
+}
+
+SubImage scale_area(const SubImage& sub, const ScaleTarget& target, bool debug) {
+	return scale_helper(sub, target, AreaScaler(), debug);
+}
+
+SubImage scale_bicubic(const SubImage& sub, const ScaleTarget& target, bool debug) {
+	return scale_helper(sub, target, BicubicScaler(), debug);
+}
+
+SubImage scale_lanczos(const SubImage& sub, const ScaleTarget& target, bool debug) {
+	return scale_helper(sub, target, LanczosScaler(), debug);
+}
+
+SubImage scale_filter(const SubImage& sub, const ScaleTarget& target, scale_filter_t filter) {
+	StatTimer timer(STAT_TIME_SCALE);
+	stat_add(STAT_PIXELS_SCALED, (u64)sub.width * sub.height);
+	switch(filter) {
+	case SCALE_FILTER_NN:
+		return scale_nn(sub, target);
+	case SCALE_FILTER_BILINEAR:
+		return scale_bl(sub, target);
+	case SCALE_FILTER_AREA:
+		return scale_area(sub, target);
+	case SCALE_FILTER_BICUBIC:
+		return scale_bicubic(sub, target);
+	case SCALE_FILTER_LANCZOS:
+		return scale_lanczos(sub, target);
+	}
+	return scale_bl(sub, target);
+}
+
+bool parse_scale_filter(const char* name, scale_filter_t& filter) {
+	static const struct {
+		const char* name;
+		scale_filter_t filter;
+	} filters[] = {
+		{ "nn", SCALE_FILTER_NN },
+		{ "bilinear", SCALE_FILTER_BILINEAR },
+		{ "area", SCALE_FILTER_AREA },
+		{ "bicubic", SCALE_FILTER_BICUBIC },
+		{ "lanczos", SCALE_FILTER_LANCZOS },
+	};
+	for(size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+		if(strcmp(name, filters[i].name) == 0) {
+			filter = filters[i].filter;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,155 @@
+#include "scale.hpp"
+
+#include <cstring>
+
+/* SSE2 and AVX2 versions of the row kernels in scale.cpp. The functions
+ * carry target attributes so the file builds without -msse2/-mavx2 and the
+ * set is only handed out when the running CPU supports it. Pixel tails
+ * that do not fill a vector go through the scalar kernels. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static void nn_row_sse2(const u32* src, u32* dst, const u32* index, u32 width) {
+	u32 x = 0;
+	for(; x + 4 <= width; x += 4) {
+		__m128i v = _mm_set_epi32(src[index[x + 3]], src[index[x + 2]],
+		                          src[index[x + 1]], src[index[x]]);
+		_mm_storeu_si128((__m128i*)(dst + x), v);
+	}
+	scale_kernels_scalar().nn_row(src, dst + x, index + x, width - x);
+}
+
+/* weights of two pixels as [w0 w0 w0 w0 w1 w1 w1 w1] */
+SSE2 static inline __m128i bl_weight2_sse2(const u16* weight) {
+	u32 pair;
+	memcpy(&pair, weight, sizeof(pair));
+	__m128i w = _mm_cvtsi32_si128(pair);
+	w = _mm_unpacklo_epi16(w, w);
+	return _mm_unpacklo_epi32(w, w);
+}
+
+SSE2 static void bl_hrow_sse2(const u32* src, u16* dst, const u32* first,
+                              const u32* second, const u16* weight, u32 width) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(256);
+	u32 x = 0;
+	for(; x + 2 <= width; x += 2) {
+		__m128i a = _mm_set_epi32(0, 0, src[first[x + 1]], src[first[x]]);
+		__m128i b = _mm_set_epi32(0, 0, src[second[x + 1]], src[second[x]]);
+		__m128i wb = bl_weight2_sse2(weight + x);
+		__m128i wa = _mm_sub_epi16(one, wb);
+		a = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), wa);
+		b = _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wb);
+		_mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_add_epi16(a, b));
+	}
+	scale_kernels_scalar().bl_hrow(src, dst + 4 * x, first + x, second + x,
+	                               weight + x, width - x);
+}
+
+/* (a * wa + b * wb + 0x8000) >> 16 for eight 16 bit channels */
+SSE2 static inline __m128i bl_blend_sse2(__m128i a, __m128i b, __m128i wa, __m128i wb) {
+	const __m128i round = _mm_set1_epi32(0x8000);
+	__m128i al = _mm_mullo_epi16(a, wa), ah = _mm_mulhi_epu16(a, wa);
+	__m128i bl = _mm_mullo_epi16(b, wb), bh = _mm_mulhi_epu16(b, wb);
+	__m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(al, ah), _mm_unpacklo_epi16(bl, bh));
+	__m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(al, ah), _mm_unpackhi_epi16(bl, bh));
+	lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 16);
+	hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 16);
+	return _mm_packs_epi32(lo, hi);
+}
+
+SSE2 static void bl_vrow_sse2(const u16* a, const u16* b, u32* dst, u32 width, u16 weight) {
+	const __m128i wb = _mm_set1_epi16(weight);
+	const __m128i wa = _mm_set1_epi16(256 - weight);
+	u32 x = 0;
+	for(; x + 4 <= width; x += 4) {
+		__m128i p0 = bl_blend_sse2(_mm_loadu_si128((const __m128i*)(a + 4 * x)),
+		                           _mm_loadu_si128((const __m128i*)(b + 4 * x)), wa, wb);
+		__m128i p1 = bl_blend_sse2(_mm_loadu_si128((const __m128i*)(a + 4 * x + 8)),
+		                           _mm_loadu_si128((const __m128i*)(b + 4 * x + 8)), wa, wb);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(p0, p1));
+	}
+	scale_kernels_scalar().bl_vrow(a + 4 * x, b + 4 * x, dst + x, width - x, weight);
+}
+
+AVX2 static void nn_row_avx2(const u32* src, u32* dst, const u32* index, u32 width) {
+	u32 x = 0;
+	for(; x + 8 <= width; x += 8) {
+		__m256i i = _mm256_loadu_si256((const __m256i*)(index + x));
+		__m256i v = _mm256_i32gather_epi32((const int*)src, i, 4);
+		_mm256_storeu_si256((__m256i*)(dst + x), v);
+	}
+	scale_kernels_scalar().nn_row(src, dst + x, index + x, width - x);
+}
+
+AVX2 static void bl_hrow_avx2(const u32* src, u16* dst, const u32* first,
+                              const u32* second, const u16* weight, u32 width) {
+	const __m256i one = _mm256_set1_epi16(256);
+	u32 x = 0;
+	for(; x + 4 <= width; x += 4) {
+		__m128i a = _mm_i32gather_epi32((const int*)src,
+		                                _mm_loadu_si128((const __m128i*)(first + x)), 4);
+		__m128i b = _mm_i32gather_epi32((const int*)src,
+		                                _mm_loadu_si128((const __m128i*)(second + x)), 4);
+		/* four weights to [w0 x4, w1 x4 | w2 x4, w3 x4] */
+		__m128i w = _mm_loadl_epi64((const __m128i*)(weight + x));
+		w = _mm_unpacklo_epi16(w, w);
+		__m256i wb = _mm256_shuffle_epi32(_mm256_cvtepu32_epi64(w), _MM_SHUFFLE(2, 2, 0, 0));
+		__m256i wa = _mm256_sub_epi16(one, wb);
+		__m256i va = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(a), wa);
+		__m256i vb = _mm256_mullo_epi16(_mm256_cvtepu8_epi16(b), wb);
+		_mm256_storeu_si256((__m256i*)(dst + 4 * x), _mm256_add_epi16(va, vb));
+	}
+	scale_kernels_scalar().bl_hrow(src, dst + 4 * x, first + x, second + x,
+	                               weight + x, width - x);
+}
+
+AVX2 static void bl_vrow_avx2(const u16* a, const u16* b, u32* dst, u32 width, u16 weight) {
+	const __m256i wb = _mm256_set1_epi16(weight);
+	const __m256i wa = _mm256_set1_epi16(256 - weight);
+	const __m256i round = _mm256_set1_epi32(0x8000);
+	u32 x = 0;
+	for(; x + 4 <= width; x += 4) {
+		__m256i va = _mm256_loadu_si256((const __m256i*)(a + 4 * x));
+		__m256i vb = _mm256_loadu_si256((const __m256i*)(b + 4 * x));
+		__m256i al = _mm256_mullo_epi16(va, wa), ah = _mm256_mulhi_epu16(va, wa);
+		__m256i bl = _mm256_mullo_epi16(vb, wb), bh = _mm256_mulhi_epu16(vb, wb);
+		__m256i lo = _mm256_add_epi32(_mm256_unpacklo_epi16(al, ah), _mm256_unpacklo_epi16(bl, bh));
+		__m256i hi = _mm256_add_epi32(_mm256_unpackhi_epi16(al, ah), _mm256_unpackhi_epi16(bl, bh));
+		lo = _mm256_srli_epi32(_mm256_add_epi32(lo, round), 16);
+		hi = _mm256_srli_epi32(_mm256_add_epi32(hi, round), 16);
+		/* packs keep lane order, so each lane ends up with its eight bytes
+		 * in the low half */
+		__m256i p = _mm256_packus_epi16(_mm256_packs_epi32(lo, hi), _mm256_setzero_si256());
+		p = _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm256_castsi256_si128(p));
+	}
+	scale_kernels_scalar().bl_vrow(a + 4 * x, b + 4 * x, dst + x, width - x, weight);
+}
+
+const ScaleKernels* scale_kernels_sse2() {
+	static const ScaleKernels kernels = { "sse2", nn_row_sse2, bl_hrow_sse2, bl_vrow_sse2 };
+	return __builtin_cpu_supports("sse2") ? &kernels : NULL;
+}
+
+const ScaleKernels* scale_kernels_avx2() {
+	static const ScaleKernels kernels = { "avx2", nn_row_avx2, bl_hrow_avx2, bl_vrow_avx2 };
+	return __builtin_cpu_supports("avx2") ? &kernels : NULL;
+}
+
+#else
+
+const ScaleKernels* scale_kernels_sse2() {
+	return NULL;
+}
+
+const ScaleKernels* scale_kernels_avx2() {
+	return NULL;
+}
+
+#endif
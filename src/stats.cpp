@@ -0,0 +1,129 @@
+#include "stats.hpp"
+#include "buffer_pool.hpp"
+
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+std::atomic<u64> stat_counters[STAT_COUNTER_COUNT];
+std::atomic<u32> stat_last_pts(0);
+bool stat_timing = false;
+
+static std::atomic<u64> stat_times[STAT_TIMER_COUNT];
+static std::chrono::steady_clock::time_point stat_started;
+
+void StatTimer::add(stat_timer_t timer, std::chrono::steady_clock::duration elapsed)
+{
+    const u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    stat_times[timer].fetch_add(ns, std::memory_order_relaxed);
+}
+
+void stats_enable_timing()
+{
+    stat_started = std::chrono::steady_clock::now();
+    stat_timing = true;
+}
+
+static u64 counter(stat_counter_t c)
+{
+    return stat_counters[c].load(std::memory_order_relaxed);
+}
+
+static double seconds(u64 ns)
+{
+    return ns / 1e9;
+}
+
+void write_stats_json(std::ostream& out)
+{
+    static const char* const timer_names[STAT_TIMER_COUNT] = {
+        "decode", "scale", "write", "encode"
+    };
+    const u64 wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - stat_started).count();
+    char buf[32];
+
+    out << "{\n  \"seconds\": {";
+    snprintf(buf, sizeof(buf), "%.6f", seconds(stat_timing ? wall : 0));
+    out << "\"wall\": " << buf;
+    for (int i = 0; i < STAT_TIMER_COUNT; i++)
+    {
+        snprintf(buf, sizeof(buf), "%.6f",
+                 seconds(stat_times[i].load(std::memory_order_relaxed)));
+        out << ", \"" << timer_names[i] << "\": " << buf;
+    }
+    out << "},\n"
+        << "  \"segments\": {"
+        << "\"pcs\": " << counter(STAT_SEGMENTS_TIMECODES)
+        << ", \"wds\": " << counter(STAT_SEGMENTS_WINDOW)
+        << ", \"pds\": " << counter(STAT_SEGMENTS_PALETTE)
+        << ", \"ods\": " << counter(STAT_SEGMENTS_IMAGE)
+        << ", \"end\": " << counter(STAT_SEGMENTS_END)
+        << ", \"other\": " << counter(STAT_SEGMENTS_OTHER) << "},\n"
+        << "  \"bytes_read\": " << counter(STAT_BYTES_READ) << ",\n"
+        << "  \"bytes_written\": " << counter(STAT_BYTES_WRITTEN) << ",\n"
+        << "  \"files_written\": " << counter(STAT_FILES_WRITTEN) << ",\n"
+        << "  \"images\": " << counter(STAT_IMAGES) << ",\n"
+        << "  \"pixels_decoded\": " << counter(STAT_PIXELS_DECODED) << ",\n"
+        << "  \"pixels_scaled\": " << counter(STAT_PIXELS_SCALED) << ",\n"
+        << "  \"cache\": {"
+        << "\"object_hits\": " << counter(STAT_OBJECT_CACHE_HITS)
+        << ", \"object_misses\": " << counter(STAT_OBJECT_CACHE_MISSES)
+        << ", \"dedup_hits\": " << counter(STAT_DEDUP_HITS)
+        << ", \"x_axis_hits\": " << counter(STAT_X_AXIS_HITS)
+        << ", \"x_axis_misses\": " << counter(STAT_X_AXIS_MISSES)
+        << ", \"y_axis_hits\": " << counter(STAT_Y_AXIS_HITS)
+        << ", \"y_axis_misses\": " << counter(STAT_Y_AXIS_MISSES) << "},\n"
+        << "  \"peak_buffer_bytes\": " << pixel_pool().peak() << ",\n"
+        << "  \"last_pts\": " << stat_last_pts.load(std::memory_order_relaxed) << "\n"
+        << "}" << std::endl;
+}
+
+static std::mutex progress_mutex;
+static std::condition_variable progress_wake;
+static std::thread progress_thread;
+static bool progress_stop = false;
+
+static void print_progress()
+{
+    const u32 pts = stat_last_pts.load(std::memory_order_relaxed);
+    const u32 s = pts / 90000;
+    fprintf(stderr, "\rposition %02u:%02u:%02u.%03u  images %llu  read %.1f MiB ",
+            s / 3600, s / 60 % 60, s % 60, pts % 90000 / 90,
+            (unsigned long long)counter(STAT_IMAGES),
+            counter(STAT_BYTES_READ) / 1048576.0);
+}
+
+static void progress_worker(double interval)
+{
+    const std::chrono::milliseconds period((long long)(interval * 1000));
+    std::unique_lock<std::mutex> lock(progress_mutex);
+    while (!progress_wake.wait_for(lock, period, [] { return progress_stop; }))
+    {
+        print_progress();
+    }
+    /* the final position, on a line of its own */
+    print_progress();
+    fputc('\n', stderr);
+}
+
+void start_progress(double interval)
+{
+    progress_stop = false;
+    progress_thread = std::thread(progress_worker, interval);
+}
+
+void stop_progress()
+{
+    if (!progress_thread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        progress_stop = true;
+    }
+    progress_wake.notify_one();
+    progress_thread.join();
+}
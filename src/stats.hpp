@@ -0,0 +1,112 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "common.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+/* Process wide counters, updated from any thread */
+enum stat_counter_t
+{
+    STAT_SEGMENTS_PALETTE,
+    STAT_SEGMENTS_IMAGE,
+    STAT_SEGMENTS_TIMECODES,
+    STAT_SEGMENTS_WINDOW,
+    STAT_SEGMENTS_END,
+    STAT_SEGMENTS_OTHER,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    /* subtitle images decoded, or objects rewritten by rescale_pgs() */
+    STAT_IMAGES,
+    STAT_PIXELS_DECODED,
+    STAT_PIXELS_SCALED,
+    STAT_FILES_WRITTEN,
+    STAT_OBJECT_CACHE_HITS,
+    STAT_OBJECT_CACHE_MISSES,
+    STAT_DEDUP_HITS,
+    STAT_X_AXIS_HITS,
+    STAT_X_AXIS_MISSES,
+    STAT_Y_AXIS_HITS,
+    STAT_Y_AXIS_MISSES,
+    STAT_COUNTER_COUNT
+};
+
+/* Stages with a timer, the times add up over all threads */
+enum stat_timer_t
+{
+    STAT_TIME_DECODE,
+    STAT_TIME_SCALE,
+    STAT_TIME_WRITE,
+    STAT_TIME_ENCODE,
+    STAT_TIMER_COUNT
+};
+
+extern std::atomic<u64> stat_counters[STAT_COUNTER_COUNT];
+extern std::atomic<u32> stat_last_pts;
+extern bool stat_timing;
+
+/* Counting is a relaxed add, cheap enough to leave on whether or not the
+ * numbers are ever printed */
+inline void stat_add(stat_counter_t counter, u64 n = 1)
+{
+    stat_counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+/* Latest presentation time (90 kHz ticks) read from the input. Parallel
+ * decoding reads out of order, the furthest one wins. */
+inline void stat_position(u32 pts)
+{
+    if (pts > stat_last_pts.load(std::memory_order_relaxed))
+    {
+        stat_last_pts.store(pts, std::memory_order_relaxed);
+    }
+}
+
+/* Times one stage from construction to destruction. The clock is only
+ * read after stats_enable_timing(), before that a timer is a flag test. */
+class StatTimer
+{
+public:
+    explicit StatTimer(stat_timer_t timer)
+        : timer_(timer), running_(stat_timing)
+    {
+        if (running_)
+        {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StatTimer()
+    {
+        if (running_)
+        {
+            add(timer_, std::chrono::steady_clock::now() - start_);
+        }
+    }
+
+private:
+    StatTimer(const StatTimer&);
+    StatTimer& operator=(const StatTimer&);
+
+    static void add(stat_timer_t timer, std::chrono::steady_clock::duration elapsed);
+
+    const stat_timer_t timer_;
+    const bool running_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/* Call before starting any threads */
+void stats_enable_timing();
+
+/* Counters, stage times, wall time since stats_enable_timing() and the
+ * peak pixel buffer memory as one JSON object */
+void write_stats_json(std::ostream& out);
+
+/* Prints the position, images and bytes read to stderr every interval
+ * seconds until stop_progress() */
+void start_progress(double interval);
+void stop_progress();
+
+#endif /* STATS_HPP */
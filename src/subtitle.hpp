@@ -2,15 +2,92 @@
 #define SUBTITLE_HPP
 
 #include "common.hpp"
+#include "buffer_pool.hpp"
+#include <cstring>
 #include <list>
 #include <string>
+#include <utility>
 
 class SubImage
 {
 public:
-	SubImage(u32 w, u32 h)
-	: width(w), height(h) {
-		rgba = new u32[w*h];
+	enum format_t {
+		RGBA,
+		/* 8 bit indices into palette, rgba is NULL */
+		INDEXED,
+	};
+
+	SubImage()
+	: start_s(0), start_ns(0), duration_s(0), duration_ns(0), x(0), y(0),
+	  width(0), height(0), rgba(NULL), index(NULL), forced(false),
+	  capacity_(0) {
+	}
+
+	/* pixels come from pixel_pool() and go back when the image is
+	 * destroyed or assigned to */
+	SubImage(u32 w, u32 h, format_t format = RGBA)
+	: start_s(0), start_ns(0), duration_s(0), duration_ns(0), x(0), y(0),
+	  width(w), height(h), rgba(NULL), index(NULL), forced(false) {
+		if (format == INDEXED)
+			index = static_cast<u8*>(pixel_pool().acquire(w*h, capacity_));
+		else
+			rgba = static_cast<u32*>(pixel_pool().acquire(w*h*sizeof(u32), capacity_));
+	}
+
+	/* move only, the moved from image is left empty */
+	SubImage(SubImage&& other)
+	: rgba(NULL), index(NULL), capacity_(0) {
+		*this = std::move(other);
+	}
+
+	SubImage& operator=(SubImage&& other) {
+		if (this == &other)
+			return *this;
+		release();
+		start_s = other.start_s;
+		start_ns = other.start_ns;
+		duration_s = other.duration_s;
+		duration_ns = other.duration_ns;
+		x = other.x;
+		y = other.y;
+		width = other.width;
+		height = other.height;
+		rgba = other.rgba;
+		index = other.index;
+		capacity_ = other.capacity_;
+		if (index != NULL)
+			memcpy(palette, other.palette, sizeof(palette));
+		forced = other.forced;
+		other.width = other.height = 0;
+		other.rgba = NULL;
+		other.index = NULL;
+		other.capacity_ = 0;
+		return *this;
+	}
+
+	~SubImage() {
+		release();
+	}
+
+	SubImage(const SubImage&) = delete;
+	SubImage& operator=(const SubImage&) = delete;
+
+	bool indexed() const {
+		return index != NULL;
+	}
+
+	/* start, duration and forced flag of other */
+	void copy_timing(const SubImage& other) {
+		start_s = other.start_s;
+		start_ns = other.start_ns;
+		duration_s = other.duration_s;
+		duration_ns = other.duration_ns;
+		forced = other.forced;
+	}
+
+	/* colour of pixel i in either format */
+	u32 pixel(u32 i) const {
+		return index != NULL ? palette[index[i]] : rgba[i];
 	}
 
     u64 start_s;
@@ -22,13 +99,32 @@ public:
 
     u32 width, height;
     u32* rgba;
+    u8* index;
+    u32 palette[256];
 
     bool forced;
+
+private:
+	void release() {
+		pixel_pool().release(rgba != NULL ? static_cast<void*>(rgba) : index,
+		                     capacity_);
+		rgba = NULL;
+		index = NULL;
+		capacity_ = 0;
+	}
+
+	/* bytes behind rgba or index */
+	size_t capacity_;
 };
 
 class Subtitle
 {
 public:
+    Subtitle()
+        : width(0), height(0), fps(0)
+    {
+    }
+
     std::string title, lang;
 
     /* screen size, 0 if unknown */
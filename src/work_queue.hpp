@@ -0,0 +1,61 @@
+#ifndef WORK_QUEUE_HPP
+#define WORK_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/* Bounded multi-producer, multi-consumer queue. push() blocks while the
+ * queue is full, pop() blocks while it is empty and returns false once the
+ * queue has been closed and drained. */
+template<typename T>
+class WorkQueue
+{
+public:
+    explicit WorkQueue(size_t capacity)
+        : capacity_(capacity > 0 ? capacity : 1), closed_(false)
+    {
+    }
+
+    void push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+        queue_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !queue_.empty() || closed_; });
+        if (queue_.empty())
+        {
+            return false;
+        }
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    WorkQueue(const WorkQueue&);
+    WorkQueue& operator=(const WorkQueue&);
+
+    const size_t capacity_;
+    bool closed_;
+    std::deque<T> queue_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_, not_full_;
+};
+
+#endif /* WORK_QUEUE_HPP */